@@ -10,6 +10,9 @@
 # 1a:55:89:a2:69:41. The host will see the device
 # as having the MAC address 1a:55:89:a2:69:42.
 #
+# Run as "./hid-ecm.sh nkro" to set up an n-key rollover keyboard instead of
+# a boot keyboard; type must then be run with -N.
+#
 # Collin Mulliner <collin AT mulliner.org>
 # Quentin Young <qlyoung@qlyoung.net>
 
@@ -34,10 +37,21 @@ mkdir functions/hid.usb0
 mkdir functions/ecm.usb0
 
 # setup hid parameters for the keyboard function
-echo 1 > functions/hid.usb0/protocol
-echo 1 > functions/hid.usb0/subclass
-echo 8 > functions/hid.usb0/report_length
-echo -ne "\x05\x01\x09\x06\xA1\x01\x05\x07\x19\xE0\x29\xE7\x15\x00\x25\x01\x75\x01\x95\x08\x81\x02\x95\x01\x75\x08\x81\x03\x95\x05\x75\x01\x05\x08\x19\x01\x29\x05\x91\x02\x95\x01\x75\x03\x91\x03\x95\x06\x75\x08\x15\x00\x25\x65\x05\x07\x19\x00\x29\x65\x81\x00\xC0" > functions/hid.usb0/report_desc
+if [ "$1" = "nkro" ]; then
+	# 32-byte report: modifiers, reserved byte, then a bitmap of usages
+	# 0x00-0xEF; not a boot device, since the BIOS could not parse it
+	echo 1 > functions/hid.usb0/protocol
+	echo 0 > functions/hid.usb0/subclass
+	echo 32 > functions/hid.usb0/report_length
+	echo -ne "\x05\x01\x09\x06\xA1\x01\x05\x07\x19\xE0\x29\xE7\x15\x00\x25\x01\x75\x01\x95\x08\x81\x02\x95\x01\x75\x08\x81\x03\x95\x05\x75\x01\x05\x08\x19\x01\x29\x05\x91\x02\x95\x01\x75\x03\x91\x03\x05\x07\x19\x00\x29\xEF\x15\x00\x25\x01\x75\x01\x96\xF0\x00\x81\x02\xC0" > functions/hid.usb0/report_desc
+else
+	# 8-byte boot report; key slots accept the whole keyboard usage page
+	# (0x00-0xE7), not just the boot keyboard's 0x00-0x65
+	echo 1 > functions/hid.usb0/protocol
+	echo 1 > functions/hid.usb0/subclass
+	echo 8 > functions/hid.usb0/report_length
+	echo -ne "\x05\x01\x09\x06\xA1\x01\x05\x07\x19\xE0\x29\xE7\x15\x00\x25\x01\x75\x01\x95\x08\x81\x02\x95\x01\x75\x08\x81\x03\x95\x05\x75\x01\x05\x08\x19\x01\x29\x05\x91\x02\x95\x01\x75\x03\x91\x03\x95\x06\x75\x08\x15\x00\x26\xE7\x00\x05\x07\x19\x00\x29\xE7\x81\x00\xC0" > functions/hid.usb0/report_desc
+fi
 
 # set the host and device MAC addresses to be the same as the armory's
 # default Debian Jessie MAC address as set in /etc/modprobe/usbarmory.conf
@@ -0,0 +1,46 @@
+#ifndef ASCII_H
+#define ASCII_H
+
+#include "layouts.h"
+#include <stddef.h>
+
+/**
+ * Kernels for encode_ascii(). The vector kernels translate a block of 16 or
+ * 32 characters at a time by looking them up in the ASCII tables of the
+ * layout index with byte shuffles; the scalar kernel does one character at
+ * a time and is always available.
+ */
+#define ASCII_KERNEL_AUTO 0
+#define ASCII_KERNEL_SCALAR 1
+#define ASCII_KERNEL_SSSE3 2
+#define ASCII_KERNEL_AVX2 3
+#define ASCII_KERNEL_NEON 4
+
+/**
+ * Selects the kernel used by encode_ascii(). By default the fastest kernel
+ * the CPU supports is picked on first use.
+ *
+ * @param[in] kernel one of the ASCII_KERNEL_* constants
+ * @return 0 on success, -1 if the kernel is not supported on this CPU
+ */
+int select_ascii_kernel(int kernel);
+
+/**
+ * Encodes the run of ASCII characters at the start of a string into boot
+ * reports, one report per character.
+ *
+ * Encoding stops at the first byte that is not ASCII or whose character the
+ * layout does not map to a key; the caller takes it from there with the
+ * general lookup.
+ *
+ * @param[in] index lookup index of the layout
+ * @param[in] ascii characters to encode
+ * @param[in] len number of bytes at ascii
+ * @param[out] reports buffer with room for len boot reports. Reports past
+ *  the returned count may be clobbered.
+ * @return number of characters encoded
+ */
+size_t encode_ascii(const struct LayoutIndex *index, const char *ascii,
+		    size_t len, char *reports);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "kybdutil.h"
+#include "program.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * A directory of compiled scripts, so that a script that has been typed
+ * before is not parsed and encoded again.
+ *
+ * Scripts are looked up by a hash of everything their compiled form
+ * depends on: the script, the layout, the encoding options and the
+ * version of the encoder. Each is stored as a payload file named after
+ * its key, written to a temporary file and renamed into place, so that
+ * concurrent runs never see half of one. Once the payloads take up more
+ * than the size cap, the least recently used are deleted.
+ */
+
+/**
+ * Version of the encoder, part of every key. Bump it whenever the same
+ * script and layout would compile to different code.
+ */
+#define ENCODER_VERSION 2
+
+/** Cache size cap used by type */
+#define CACHE_DEFAULT_MAX_SIZE (64 << 20)
+
+/** Number of hex digits in a key */
+#define CACHE_KEY_LEN 16
+
+struct CacheKey {
+	// 64-bit FNV-1a hash of everything added so far
+	uint64_t hash;
+};
+
+struct ScriptCache {
+	// directory holding the payloads
+	char dir[PATH_MAX];
+	// most bytes of payloads to keep
+	size_t max_size;
+	// lookups that found the script and that did not, counted over all
+	// runs using the directory, as of the last lookup
+	uint64_t hits, misses;
+};
+
+/**
+ * Starts a key for a script compiled with a context's options.
+ *
+ * @param[out] key key to start
+ * @param[in] ctx encoding context the script is compiled with
+ */
+void init_cache_key(struct CacheKey *key, const struct KbdCtx *ctx);
+
+/**
+ * Starts a key for a script compiled with a context's options by a given
+ * version of the encoder. init_cache_key() uses ENCODER_VERSION.
+ *
+ * @param[out] key key to start
+ * @param[in] ctx encoding context the script is compiled with
+ * @param[in] version version of the encoder
+ */
+void init_cache_key_version(struct CacheKey *key, const struct KbdCtx *ctx,
+			    uint32_t version);
+
+/**
+ * Adds data, such as the text of a layout, to a key.
+ *
+ * @param[in] key key to add to
+ * @param[in] data data to add
+ * @param[in] len length of the data
+ */
+void add_cache_key(struct CacheKey *key, const void *data, size_t len);
+
+/**
+ * Adds the contents of a file to a key, and rewinds it.
+ *
+ * @param[in] key key to add to
+ * @param[in] file file to add, opened for reading; must be seekable
+ * @return 0 on success, -1 with errno set on failure
+ */
+int add_cache_key_file(struct CacheKey *key, FILE *file);
+
+/**
+ * Opens a cache directory, creating it if needed, and deletes temporary
+ * files left in it by runs that died while storing a payload.
+ *
+ * @param[out] cache cache to open
+ * @param[in] dir directory to use, or NULL for $XDG_CACHE_HOME/armorykbd,
+ *  or ~/.cache/armorykbd without XDG_CACHE_HOME
+ * @param[in] max_size most bytes of payloads to keep
+ * @return 0 on success, -1 with errno set on failure
+ */
+int open_cache(struct ScriptCache *cache, const char *dir, size_t max_size);
+
+/**
+ * Looks up a compiled script, and counts a hit or a miss. A payload that
+ * is found is mapped and marked as used.
+ *
+ * @param[in] cache cache to look in
+ * @param[in] key key of the script
+ * @param[out] prog the mapped program on a hit, to free with free_program()
+ * @return 0 on a hit, -1 with errno set on a miss
+ */
+int load_cached(struct ScriptCache *cache, const struct CacheKey *key,
+		struct Program *prog);
+
+/**
+ * Stores a compiled script, replacing any payload with the same key, then
+ * evicts the least recently used payloads until the cache is back under
+ * its size cap.
+ *
+ * @param[in] cache cache to store in
+ * @param[in] key key of the script
+ * @param[in] prog compiled script
+ * @return 0 on success, -1 with errno set on failure
+ */
+int store_cached(struct ScriptCache *cache, const struct CacheKey *key,
+		 const struct Program *prog);
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Capture files record a stream of reports with the time each was sent and
+ * where in the script it came from.
+ *
+ * A file is a CaptureHeader followed by fixed-size records, each a
+ * CaptureRecord followed by the report, padded to a multiple of 8 bytes.
+ * Records are only ever appended, and a file can be read in place with
+ * map_capture(). Everything is in host byte order.
+ */
+#define CAPTURE_MAGIC "AKCP"
+#define CAPTURE_VERSION 1
+/** Longest report a capture holds */
+#define CAPTURE_MAX_REPORT 64
+
+/** Header flag: times are virtual, counted from the start of the script */
+#define CAPTURE_VIRTUAL 1
+
+struct CaptureHeader {
+	// CAPTURE_MAGIC, not null-terminated
+	char magic[4];
+	// CAPTURE_VERSION
+	uint16_t version;
+	// length of the report in each record
+	uint16_t report_size;
+	// length of each record, report and padding included
+	uint32_t record_size;
+	// CAPTURE_* flags
+	uint32_t flags;
+};
+
+struct CaptureRecord {
+	// CLOCK_MONOTONIC time the report was sent at in ns, or with
+	// CAPTURE_VIRTUAL, the virtual time since the start of the script
+	uint64_t time;
+	// script line the report came from, counting from 1, 0 if unknown
+	uint32_t line;
+	// CMD_* of the command on that line, 0 if unknown
+	uint16_t cmd;
+	uint16_t reserved;
+	// the report, report_size bytes
+	unsigned char report[];
+};
+
+/** Longest record, that of a CAPTURE_MAX_REPORT report */
+#define CAPTURE_MAX_RECORD (sizeof(struct CaptureRecord) + CAPTURE_MAX_REPORT)
+
+/**
+ * A capture file mapped into memory.
+ */
+struct Capture {
+	const struct CaptureHeader *header;
+	// first record
+	const char *records;
+	// number of complete records
+	size_t count;
+	// length of the mapping
+	size_t len;
+};
+
+/**
+ * Returns the length of each record for reports of a given length.
+ *
+ * @param[in] report_size length of each report
+ * @return length of each record
+ */
+static inline size_t capture_record_size(size_t report_size)
+{
+	return (sizeof(struct CaptureRecord) + report_size + 7) & ~(size_t)7;
+}
+
+/**
+ * Fills in a header for a new capture file.
+ *
+ * @param[out] header header to fill in
+ * @param[in] report_size length of each report, at most CAPTURE_MAX_REPORT
+ * @param[in] flags CAPTURE_* flags
+ */
+void init_capture_header(struct CaptureHeader *header, size_t report_size,
+			 uint32_t flags);
+
+/**
+ * Checks that a header belongs to a capture file this version can read.
+ *
+ * @param[in] header header to check
+ * @return 0 if it does, -1 with errno set to EINVAL if not
+ */
+int check_capture_header(const struct CaptureHeader *header);
+
+/**
+ * Maps a capture file for reading. A record cut short at the end of the
+ * file, as left by a writer that was killed, is not counted.
+ *
+ * @param[in] fd file descriptor of the capture file
+ * @param[out] cap the mapped capture
+ * @return 0 on success, -1 with errno set on failure
+ */
+int map_capture(int fd, struct Capture *cap);
+
+/**
+ * Unmaps a capture file mapped with map_capture().
+ *
+ * @param[in] cap capture to unmap
+ */
+void unmap_capture(struct Capture *cap);
+
+/**
+ * Returns a record of a mapped capture.
+ *
+ * @param[in] cap mapped capture
+ * @param[in] i index of the record, less than cap->count
+ * @return the record
+ */
+static inline const struct CaptureRecord *
+capture_record(const struct Capture *cap, size_t i)
+{
+	return (const struct CaptureRecord *)(cap->records
+					      + i * cap->header->record_size);
+}
+
+#endif
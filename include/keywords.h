@@ -0,0 +1,80 @@
+#ifndef KEYWORDS_H
+#define KEYWORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Keyword types */
+#define KW_COMMAND 1
+#define KW_ESCAPE 2
+
+/** Script commands */
+#define CMD_REM 1
+#define CMD_DEFAULT_DELAY 2
+#define CMD_DELAY 3
+#define CMD_STRING 4
+#define CMD_SIMUL 5
+/** Not a keyword: a line holding a bare escape token */
+#define CMD_KEY 6
+/** Repeats the command before it */
+#define CMD_REPEAT 7
+/** Types the lines up to END_STRING */
+#define CMD_STRING_BLOCK 8
+#define CMD_END_STRING 9
+
+/**
+ * A script keyword: either a command that starts a line or an escape token
+ * naming an unprintable key. Aliases are separate entries with the same
+ * type and value.
+ */
+struct Keyword {
+	// keyword text, NULL for an empty table slot
+	const char *name;
+	// length of name
+	uint8_t len;
+	// KW_COMMAND or KW_ESCAPE
+	uint8_t type;
+	// CMD_* for commands, escape codepoint for escapes
+	uint32_t value;
+};
+
+/**
+ * Hash function used by the keyword table. Shared between the table
+ * generator and lookup_keyword() so that both agree on every slot.
+ *
+ * @param[in] token keyword text
+ * @param[in] len length of token
+ * @param[in] seed seed picked by the generator
+ * @return 32-bit hash of the token
+ */
+static inline uint32_t keyword_hash(const char *token, size_t len,
+				    uint32_t seed)
+{
+	// FNV-1a, followed by the MurmurHash3 finalizer to spread the bits
+	uint32_t h = 2166136261u ^ seed;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)token[i];
+		h *= 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/**
+ * Looks up a keyword. The table is a perfect hash generated at build time,
+ * so this costs one hash and one comparison.
+ *
+ * @param[in] token keyword text, need not be null-terminated
+ * @param[in] len length of token
+ * @return the keyword, or NULL if token is not a keyword
+ */
+const struct Keyword *lookup_keyword(const char *token, size_t len);
+
+#endif
@@ -2,14 +2,53 @@
 #define KYBDUTIL_H
 
 #include "layouts.h"
+#include <sys/types.h>
 
 /**
- * Set the layout to use. Must be called before any other function in this
- * unit is called.
+ * Report formats. The boot format is the 8-byte report every host
+ * understands, with room for 6 keys. The NKRO format replaces the key slots
+ * with a bitmap of all usages from 0x00 to 0xEF, so any number of keys can
+ * be down at once; it needs the matching report descriptor, which
+ * hid-ecm.sh sets up when run with "nkro".
+ */
+#define REPORT_BOOT 0
+#define REPORT_NKRO 1
+
+/**
+ * Encoding context. Holds everything needed to turn characters and keys
+ * into reports: the layout (with its lookup index), the report format and
+ * the interpreter's settings. Every entry point that
+ * encodes or interprets takes a context, so contexts with different layouts
+ * can be used side by side, from different threads. A layout can be shared
+ * by any number of contexts.
+ */
+struct KbdCtx {
+	// layout to map characters with
+	const struct Layout *layout;
+	// report format, REPORT_BOOT or REPORT_NKRO
+	int format;
+	// milliseconds to wait after each script command
+	long defdelay;
+	// whether to send releases only where they are needed
+	bool elide_releases;
+};
+
+/**
+ * Initializes a context with default settings: boot reports, no default
+ * delay, a release after every key press.
  *
- * @param[in] lo pointer to layout to use
+ * @param[out] ctx context to initialize
+ * @param[in] layout layout to use, must outlive the context
  */
-void set_layout(struct Layout *lo);
+void kbd_ctx_init(struct KbdCtx *ctx, const struct Layout *layout);
+
+/**
+ * Returns the size in bytes of the reports of a format.
+ *
+ * @param[in] format REPORT_BOOT or REPORT_NKRO
+ * @return report size
+ */
+size_t report_size(int format);
 
 /**
  * Generates and returns an 8-byte USB HID keyboard report.
@@ -20,19 +59,27 @@ void set_layout(struct Layout *lo);
  * to an HID host.
  *
  * Example call to send GUI + r, which has 1 escape code and 1 ASCII character:
- * make_hid_report(report, 1, 2, GUI, 'r');
+ * make_hid_report(ctx, report, 1, 2, GUI, 'r');
  *
  * The 8-byte char array pointed to by report will then contain an HID report
  * specifying the GUI + r key combo (1 special key, 2 keys total).
  *
- * This function assumes the short report format, so at most 6 keys may be
- * be passed. If more than 6 are passed, the first 6 will be used.
+ * In the boot report format, at most 6 keys may be passed. If more than 6
+ * are passed, the first 6 will be used. In the NKRO format, up to
+ * MAX_SIMUL_KEYS keys may be passed, and the report must be NKRO_REPORT_SIZE
+ * bytes long.
  *
  * Report format:
  * Byte    0: Bit field for modifier keys (shift, alt, win, etc)
  * Byte    1: Reserved (0x00)
  * Bytes 2-7: usage id's of character data (see spec)
  *
+ * NKRO report format:
+ * Byte     0: Bit field for modifier keys
+ * Byte     1: Reserved (0x00)
+ * Bytes 2-31: bitmap of pressed keys, bit n % 8 of byte 2 + n / 8 for
+ *             usage id n
+ *
  * Uppercase alpha character are handled by converting them to lowercase,
  * coding for the lowercase key, and indicating l+r shift in the modifier byte.
  * See HID Usage Tables, Page 0x07 for this conversion.
@@ -42,20 +89,25 @@ void set_layout(struct Layout *lo);
  * USB HID Usage Tables, Section 10 (Keyboards)
  *
  * numescape and argc parameters must satisfy the following conditions:
- *  1 <= argc <= 6
+ *  1 <= argc <= MAX_SIMUL_KEYS
  *  0 <= numescape <= argc
  *
  * If they do not, behavior is undefined. If argc does not match the number of
- * arguments passed, behavior is undefined. If the layout has not been set
- * with set_layout
+ * arguments passed, behavior is undefined.
+ *
+ * The report is generated in the context's format with the context's
+ * layout.
  *
+ * @param[in] ctx encoding context
  * @param[out] report pointer to 8 byte array of char to store the result in
  * @param[in] the number of escape characters passed
  * @param[in] argc the total number of characters passed
  * @param[in] ... the UTF-8 codepoints to encode into the report, escapes first
  * @return 0 on success, -1 if a character with no known mapping is encountered
+ *  or the context has no layout
  */
-int make_hid_report(char *report, int numescape, int argc, ...);
+int make_hid_report(struct KbdCtx *ctx, char *report, int numescape, int argc,
+		    ...);
 
 /**
  * Generates and returns an 8-byte USB HID keyboard report.
@@ -66,20 +118,28 @@ int make_hid_report(char *report, int numescape, int argc, ...);
  * to an HID host.
  *
  * Example call to send GUI + r, which has 1 escape code and 1 ASCII character:
- * char chars[2] = { GUI, 'r' };
- * make_hid_report(report, 1, 2, &chars);
+ * uint32_t chars[2] = { GUI, 'r' };
+ * make_hid_report_arr(ctx, report, 1, 2, chars);
  *
  * The 8-byte char array pointed to by report will then contain an HID report
  * specifying the GUI + r key combo (1 special key, 2 keys total).
  *
- * This function assumes the short report format, so at most 6 keys may be
- * be passed. If more than 6 are passed, the first 6 will be used.
+ * In the boot report format, at most 6 keys may be passed. If more than 6
+ * are passed, the first 6 will be used. In the NKRO format, up to
+ * MAX_SIMUL_KEYS keys may be passed, and the report must be NKRO_REPORT_SIZE
+ * bytes long.
  *
  * Report format:
  * Byte    0: Bit field for modifier keys (shift, alt, win, etc)
  * Byte    1: Reserved (0x00)
  * Bytes 2-7: usage id's of character data (see spec)
  *
+ * NKRO report format:
+ * Byte     0: Bit field for modifier keys
+ * Byte     1: Reserved (0x00)
+ * Bytes 2-31: bitmap of pressed keys, bit n % 8 of byte 2 + n / 8 for
+ *             usage id n
+ *
  * Uppercase alpha character are handled by converting them to lowercase,
  * coding for the lowercase key, and indicating l+r shift in the modifier byte.
  * See HID Usage Tables, Page 0x07 for this conversion.
@@ -89,12 +149,13 @@ int make_hid_report(char *report, int numescape, int argc, ...);
  * USB HID Usage Tables, Section 10 (Keyboards)
  *
  * numescape and argc parameters must satisfy the following conditions:
- *  1 <= argc <= 6
+ *  1 <= argc
  *  0 <= numescape <= argc
  *
  * If they do not, behavior is undefined. If argc does not match the number of
  * arguments passed, behavior is undefined.
  *
+ * @param[in] ctx encoding context
  * @param[out] report pointer to 8 byte array of char to store the result in
  * @param[in] the number of escape characters passed
  * @param[in] argc the total number of characters passed
@@ -103,13 +164,120 @@ int make_hid_report(char *report, int numescape, int argc, ...);
  * @return 0 on success, -1 if a character with no known mapping is encountered,
  * or if NULL is passed as the last parameter
  */
-int make_hid_report_arr(char *report, int numescape, int argc,
-			uint32_t *codepoints);
+int make_hid_report_arr(struct KbdCtx *ctx, char *report, int numescape,
+			int argc, uint32_t *codepoints);
 
 /**
  * Define HID report length.
  */
 #define HID_REPORT_SIZE 8
 
+/** Length of an NKRO report */
+#define NKRO_REPORT_SIZE 32
+
+/** Length of the largest report of any format */
+#define MAX_REPORT_SIZE NKRO_REPORT_SIZE
+
+/** Number of keys that fit in a boot report */
+#define BOOT_REPORT_KEYS 6
+
+/** Most keys that make_hid_report() accepts at once */
+#define MAX_SIMUL_KEYS 32
+
+/**
+ * A character that encode_string() could not encode.
+ */
+struct EncodeError {
+	// byte offset of the character in the input
+	size_t offset;
+	// codepoint of the character, 0 if the input was not valid UTF-8
+	uint32_t codepoint;
+};
+
+/**
+ * Growable array of HID reports, as produced by encode_string(), along
+ * with the characters that could not be encoded.
+ */
+struct ReportBuf {
+	// format of the reports, REPORT_BOOT or REPORT_NKRO
+	int format;
+	// size of each report in bytes
+	size_t report_size;
+	// reports, report_size bytes each
+	char *reports;
+	// number of reports in the buffer
+	size_t len;
+	// number of reports the buffer has room for
+	size_t cap;
+	// characters that could not be encoded
+	struct EncodeError *errors;
+	// number of errors
+	size_t nerrors;
+	// number of errors there is room for
+	size_t errcap;
+};
+
+/**
+ * Initializes an empty report buffer with room for cap reports.
+ *
+ * @param[out] buf buffer to initialize
+ * @param[in] format format of the reports, REPORT_BOOT or REPORT_NKRO
+ * @param[in] cap number of reports to preallocate
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int init_report_buf(struct ReportBuf *buf, int format, size_t cap);
+
+/**
+ * Empties a report buffer, keeping its memory.
+ *
+ * @param[in] buf buffer to clear
+ */
+void clear_report_buf(struct ReportBuf *buf);
+
+/**
+ * Frees the memory held by a report buffer.
+ *
+ * @param[in] buf buffer to free
+ */
+void free_report_buf(struct ReportBuf *buf);
+
+/**
+ * Returns a pointer to the n-th report in a buffer.
+ */
+#define REPORT_AT(buf, n) ((buf)->reports + (n) * (buf)->report_size)
+
+/**
+ * Appends a copy of a report to a buffer, growing it if needed.
+ *
+ * @param[in] buf buffer to append to
+ * @param[in] report report to append, in the buffer's format
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int append_report(struct ReportBuf *buf, const char *report);
+
+/**
+ * Encodes a run of UTF-8 text into HID reports, one report per character,
+ * and appends them to a report buffer.
+ *
+ * Each report presses the key for one character, as make_hid_report() would
+ * generate it in the buffer's format. Characters with no mapping in the
+ * layout produce no report; they are recorded in the buffer's errors instead
+ * and encoding goes on.
+ *
+ * The buffer grows as needed, but never more than once per call: a buffer
+ * with room for len more reports is never reallocated.
+ *
+ * @param[in] ctx encoding context, supplying the layout
+ * @param[in] utf8 text to encode, need not be null-terminated
+ * @param[in] len length of the text in bytes
+ * @param[in,out] out buffer to append reports and errors to
+ * @return number of reports appended, or -1 with errno set to EILSEQ if the
+ *  text is not valid UTF-8 (nothing is appended, and the offset of the first
+ *  bad sequence is recorded as an error with codepoint 0), or to ENOMEM if
+ *  memory could not be allocated
+ */
+ssize_t encode_string(const struct KbdCtx *ctx, const char *utf8, size_t len,
+		      struct ReportBuf *out);
+
 
 #endif
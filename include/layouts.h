@@ -44,7 +44,143 @@
 #define F10 36
 #define F11 37
 #define F12 38
+#define NONUS_HASH 39
+#define KP_SLASH 40
+#define KP_ASTERISK 41
+#define KP_MINUS 42
+#define KP_PLUS 43
+#define KP_ENTER 44
+#define KP_1 45
+#define KP_2 46
+#define KP_3 47
+#define KP_4 48
+#define KP_5 49
+#define KP_6 50
+#define KP_7 51
+#define KP_8 52
+#define KP_9 53
+#define KP_0 54
+#define KP_DOT 55
+#define NONUS_BSLASH 56
+#define APPLICATION 57
+#define POWER 58
+#define KP_EQUAL 59
+#define F13 60
+#define F14 61
+#define F15 62
+#define F16 63
+#define F17 64
+#define F18 65
+#define F19 66
+#define F20 67
+#define F21 68
+#define F22 69
+#define F23 70
+#define F24 71
+#define EXECUTE 72
+#define HELP 73
+#define SELECT 74
+#define STOP 75
+#define AGAIN 76
+#define UNDO 77
+#define CUT 78
+#define COPY 79
+#define PASTE 80
+#define FIND 81
+#define MUTE 82
+#define VOLUMEUP 83
+#define VOLUMEDOWN 84
+#define LOCKINGCAPS 85
+#define LOCKINGNUM 86
+#define LOCKINGSCROLL 87
+#define KP_COMMA 88
+#define KP_EQUALSIGN 89
+#define INTL1 90
+#define INTL2 91
+#define INTL3 92
+#define INTL4 93
+#define INTL5 94
+#define INTL6 95
+#define INTL7 96
+#define INTL8 97
+#define INTL9 98
+#define LANG1 99
+#define LANG2 100
+#define LANG3 101
+#define LANG4 102
+#define LANG5 103
+#define LANG6 104
+#define LANG7 105
+#define LANG8 106
+#define LANG9 107
+#define ALTERASE 108
+#define SYSREQ 109
+#define CANCEL 110
+#define PRIOR 111
+#define RETURN 112
+#define SEPARATOR 113
+#define OUT 114
+#define OPER 115
+#define CLEARAGAIN 116
+#define CRSEL 117
+#define EXSEL 118
+#define KP_00 119
+#define KP_000 120
+#define THOUSANDSSEP 121
+#define DECIMALSEP 122
+#define CURRENCYUNIT 123
+#define CURRENCYSUBUNIT 124
+#define KP_LPAREN 125
+#define KP_RPAREN 126
+#define KP_LBRACE 127
+#define KP_RBRACE 128
+#define KP_TAB 129
+#define KP_BACKSPACE 130
+#define KP_A 131
+#define KP_B 132
+#define KP_C 133
+#define KP_D 134
+#define KP_E 135
+#define KP_F 136
+#define KP_XOR 137
+#define KP_CARET 138
+#define KP_PERCENT 139
+#define KP_LESS 140
+#define KP_GREATER 141
+#define KP_AMP 142
+#define KP_AMPAMP 143
+#define KP_BAR 144
+#define KP_BARBAR 145
+#define KP_COLON 146
+#define KP_HASH 147
+#define KP_SPACE 148
+#define KP_AT 149
+#define KP_BANG 150
+#define KP_MEMSTORE 151
+#define KP_MEMRECALL 152
+#define KP_MEMCLEAR 153
+#define KP_MEMADD 154
+#define KP_MEMSUB 155
+#define KP_MEMMUL 156
+#define KP_MEMDIV 157
+#define KP_PLUSMINUS 158
+#define KP_CLEAR 159
+#define KP_CLEARENTRY 160
+#define KP_BINARY 161
+#define KP_OCTAL 162
+#define KP_DECIMAL 163
+#define KP_HEX 164
+#define LCTRL 165
+#define LSHIFT 166
+#define LALT 167
+#define LGUI 168
+#define RCTRL 169
+#define RSHIFT 170
+#define RALT 171
+#define RGUI 172
 #define ESCAPE_END 0
+/** Number of escape codepoints, one more than the highest */
+#define ESCAPE_COUNT 173
 
 /**
  * Structure to hold a Unicode character and the
@@ -60,26 +196,165 @@ struct Keycode {
 	unsigned char mod;
 };
 
+/** Alignment of layout storage, one cache line */
+#define LAYOUT_ALIGN 64
+
+/** Number of codepoints covered by one page of the lookup index */
+#define LAYOUT_PAGE_SIZE 256
+/** Number of pages needed to cover U+0000..U+10FFFF */
+#define LAYOUT_NUM_PAGES 0x1100
+/** Number of ASCII codepoints */
+#define LAYOUT_ASCII_SIZE 128
+
+/**
+ * Lookup index from codepoint to mapping for a layout.
+ *
+ * Latin-1 codepoints are looked up in a direct table. All other codepoints
+ * go through a two-level page table: the directory selects a page of 256
+ * slots by the high bits of the codepoint, and only pages that contain at
+ * least one mapping are allocated.
+ *
+ * Slots hold the position of the mapping in the layout's map plus one, so
+ * that 0 means "unmapped".
+ *
+ * ASCII additionally has its usage IDs and modifiers in byte tables, which
+ * the vectorized encoder looks characters up in directly.
+ */
+struct LayoutIndex {
+	// slots for U+0000..U+00FF
+	uint32_t latin1[LAYOUT_PAGE_SIZE];
+	// usage ID of each ASCII character, 0 if unmapped
+	uint8_t ascii_id[LAYOUT_ASCII_SIZE];
+	// modifiers of each ASCII character, 0 if unmapped
+	uint8_t ascii_mod[LAYOUT_ASCII_SIZE];
+	// page number + 1 for each block of 256 codepoints, 0 if none
+	uint16_t dir[LAYOUT_NUM_PAGES];
+	// number of allocated pages
+	uint32_t npages;
+	// allocated pages
+	uint32_t pages[][LAYOUT_PAGE_SIZE];
+};
+
 /**
  * Structure to hold the name of the layout and
  * keycode mappings for all characters that the
- * layout supports
+ * layout supports.
+ *
+ * A layout lives in a single cache-line-aligned block: this header is
+ * followed by the map and then the index. Nothing in it is modified after
+ * loading, so a layout can be shared between threads.
  */
 struct Layout {
 	// number of mappings
 	int size;
-	// all keycode mappings for layout
-	struct Keycode **map;
+	// all keycode mappings for layout, contiguous
+	const struct Keycode *map;
+	// codepoint lookup index over map
+	const struct LayoutIndex *index;
+	// mapped layout image backing map and index, NULL if on the heap
+	void *image;
+	// length of the mapping at image
+	size_t image_len;
+};
+
+/** Size reserved for the header at the start of a layout block or image */
+#define LAYOUT_HEADER_SIZE 64
+
+/** Magic number at the start of a compiled layout image */
+#define LAYOUT_IMAGE_MAGIC "\x7fLAYOUT"
+/** Byte order mark of a compiled layout image */
+#define LAYOUT_IMAGE_BOM 0x01020304
+/** Current version of the compiled layout image format */
+#define LAYOUT_IMAGE_VERSION 2
+
+/**
+ * Header of a compiled layout image, as written by save_layout_binary().
+ *
+ * The header is followed by the map and the index exactly as they are laid
+ * out in memory, so an image can be used in place once it is mapped. All
+ * offsets are relative to the start of the image.
+ */
+struct LayoutImageHeader {
+	// LAYOUT_IMAGE_MAGIC, including the terminating NUL
+	char magic[8];
+	// LAYOUT_IMAGE_BOM as written by the compiling host
+	uint32_t bom;
+	// LAYOUT_IMAGE_VERSION
+	uint32_t version;
+	// number of mappings
+	uint32_t size;
+	// number of index pages
+	uint32_t npages;
+	// offset of the map
+	uint32_t map_off;
+	// offset of the index
+	uint32_t index_off;
+	// total length of the image
+	uint32_t length;
 };
 
+/**
+ * A compiled layout image linked into the program. The table of built-in
+ * layouts is generated at build time from the layouts/ directory.
+ */
+struct BuiltinLayout {
+	// name to select the layout by
+	const char *name;
+	// compiled layout image
+	const void *image;
+	// length of the image
+	size_t len;
+};
+
+/** Built-in layouts, terminated by an entry with a NULL name */
+extern const struct BuiltinLayout builtin_layouts[];
+
 /**
  * Load the layout with the specified name.
  *
+ * Both text layouts and compiled layout images are accepted; images are
+ * handed to load_layout_binary().
+ *
  * @param[in] layoutfile layout file opened for reading
  * @return pointer to layout, NULL on error
  */
 struct Layout *load_layout(FILE *layoutfile);
 
+/**
+ * Maps a compiled layout image read-only and uses it in place.
+ *
+ * @param[in] layoutfile image file opened for reading
+ * @return pointer to layout, NULL on error
+ */
+struct Layout *load_layout_binary(FILE *layoutfile);
+
+/**
+ * Uses a compiled layout image that is already in memory. The image is not
+ * copied and must outlive the returned layout.
+ *
+ * @param[in] image start of the image, aligned to LAYOUT_ALIGN
+ * @param[in] len length of the image
+ * @return pointer to layout, NULL if the image is invalid
+ */
+struct Layout *open_layout_image(const void *image, size_t len);
+
+/**
+ * Opens one of the layouts built into the program.
+ *
+ * @param[in] name name of the built-in layout
+ * @return pointer to layout, NULL if there is no layout by that name
+ */
+struct Layout *load_builtin_layout(const char *name);
+
+/**
+ * Writes a layout as a compiled layout image.
+ *
+ * @param[in] layout layout to write
+ * @param[in] outfile file to write the image to
+ * @return 0 on success, -1 on error
+ */
+int save_layout_binary(const struct Layout *layout, FILE *outfile);
+
 /**
  * Frees all memory used by a layout
  * @param[in] layout layout to destroy
@@ -95,7 +370,7 @@ void destroy_layout(struct Layout *layout);
  * @param[in] escape whether the passed codepoint is a predefined escape code
  * @return pointer to the mapping in the layout, or NULL no mapping was found
  */
-const struct Keycode *map_codepoint(uint32_t codepoint, struct Layout *layout,
-				    bool escape);
+const struct Keycode *map_codepoint(uint32_t codepoint,
+				    const struct Layout *layout, bool escape);
 
 #endif
@@ -0,0 +1,312 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Most reports submitted with a single writev() */
+#define HID_OUT_BATCH 64
+/** Longest report handled by every backend */
+#define HID_OUT_MAX_REPORT 64
+/** Deadline for the all-keys-up report when no deadline is set */
+#define HID_OUT_ABORT_TIMEOUT 1000
+/** Lateness in ms the schedule makes up for before starting over */
+#define HID_OUT_PACE_SLACK 20
+
+struct HidOut;
+
+/**
+ * Operations of an output backend.
+ */
+struct HidOutOps {
+	// writes n reports, returns 0 or -1 with errno set
+	int (*write)(struct HidOut *out, const char *reports, size_t n);
+	// waits ns nanoseconds after the reports written so far
+	int (*delay)(struct HidOut *out, long long ns);
+	// waits until everything written has been sent, NULL if synchronous
+	int (*flush)(struct HidOut *out);
+	// drops everything queued and sends an all-keys-up report, NULL if
+	// nothing is ever queued and the report can simply be written
+	int (*abort)(struct HidOut *out);
+	// releases the backend's resources, but not the file descriptor
+	void (*close)(struct HidOut *out);
+};
+
+/**
+ * Output for HID reports, usually a /dev/hidgX gadget device.
+ *
+ * The f_hid driver takes one report per write: a longer write is cut to the
+ * report length. Reports are therefore submitted with writev(), one iovec
+ * per report, which the kernel hands to the driver as separate writes. On a
+ * blocking descriptor, that sends a key press and its release, or a whole
+ * run of reports, with a single syscall. A non-blocking one stops at the
+ * first report the device has no room for.
+ *
+ * Descriptors are blocking until a deadline is set, which makes them
+ * non-blocking. From then on, when the device has no room for a report,
+ * the writer waits in poll() until it has, but for no longer than the
+ * output's deadline. A host that stops reading thus surfaces as ETIMEDOUT
+ * instead of a write that never returns. The io_uring backend is the
+ * exception: it keeps a blocking descriptor, and has the kernel cancel late
+ * writes instead.
+ */
+struct HidOut {
+	const struct HidOutOps *ops;
+	// file descriptor reports are written to
+	int fd;
+	// whether fd is closed along with the output
+	bool owns_fd;
+	// length of each report
+	size_t report_size;
+	// longest wait for the device to take a report in ms, -1 for no limit
+	int timeout;
+	// time between reports in ns, 0 for as fast as the device takes them
+	long interval;
+	// CLOCK_MONOTONIC time in ns the schedule has been booked up to, or
+	// for a trace, the virtual time in ns since the start
+	long long due;
+	// reports written so far
+	unsigned long reports;
+	// syscalls spent writing them
+	unsigned long syscalls;
+	// latest wake-up after a deadline on the schedule so far, in ns, or -1
+	// for outputs that do not sleep to keep it, such as io_uring and
+	// traces
+	long long max_latency;
+	// script line and CMD_* command of the reports being written, for
+	// outputs that record them
+	unsigned long line;
+	unsigned cmd;
+};
+
+/**
+ * Opens a file or gadget device for output, in blocking mode until a
+ * deadline is set. Files are appended to, and created if they do not exist.
+ *
+ * @param[in] path path to open
+ * @param[in] report_size length of each report
+ * @return the output, or NULL with errno set on failure
+ */
+struct HidOut *hid_out_open(const char *path, size_t report_size);
+
+/**
+ * Wraps an open file descriptor for output. The descriptor is not closed by
+ * hid_out_close(). It is left in the mode it is in until a deadline is set,
+ * which switches it to non-blocking mode.
+ *
+ * @param[in] fd file descriptor to write to
+ * @param[in] report_size length of each report
+ * @return the output, or NULL if memory could not be allocated
+ */
+struct HidOut *hid_out_fdopen(int fd, size_t report_size);
+
+/**
+ * Writes a run of reports in as few syscalls as possible. Writes that are
+ * interrupted or cut short are resumed where they stopped.
+ *
+ * @param[in] out output to write to
+ * @param[in] reports reports to write, back to back
+ * @param[in] n number of reports
+ * @return 0 on success, -1 with errno set on failure
+ */
+int hid_out_write(struct HidOut *out, const char *reports, size_t n);
+
+/**
+ * Sets the deadline for each report. A write that cannot hand a report to
+ * the device in time fails with ETIMEDOUT.
+ *
+ * With a deadline, the synchronous backend switches the descriptor to
+ * non-blocking mode and waits in poll(); the io_uring backend keeps it
+ * blocking and has the kernel cancel late writes.
+ *
+ * @param[in] out output to set the deadline for
+ * @param[in] ms deadline in milliseconds, -1 for no limit
+ * @return 0 on success, -1 with errno set if the descriptor could not be
+ *  made non-blocking
+ */
+int hid_out_set_timeout(struct HidOut *out, int ms);
+
+/**
+ * Sets the pace reports are written at. Without a rate, reports are written
+ * as fast as the device takes them.
+ *
+ * Pauses and paced reports are kept on a schedule of absolute deadlines, so
+ * that time spent oversleeping or writing is made up for by the next pause
+ * instead of adding up over a long script. The io_uring backend, which
+ * cannot tell when its queue reaches a pause, spaces reports with relative
+ * pauses instead.
+ *
+ * @param[in] out output to set the rate for
+ * @param[in] per_sec reports per second, 0 for no limit
+ */
+void hid_out_set_rate(struct HidOut *out, long per_sec);
+
+/**
+ * Gives up on the output after a failed write: drops whatever is still
+ * queued and sends a single all-keys-up report, so that no key stays held
+ * down on the host. Waits for the device no longer than the deadline, or
+ * HID_OUT_ABORT_TIMEOUT if there is none. Afterwards the output writes
+ * synchronously, unless the all-keys-up report could not be sent, in which
+ * case it can only be closed.
+ *
+ * @param[in] out output to abort
+ * @return 0 if the all-keys-up report was sent, -1 with errno set if not
+ */
+int hid_out_abort(struct HidOut *out);
+
+/**
+ * For backends that queue output: sends the all-keys-up report of
+ * hid_out_abort() once the queue has been dropped, writing synchronously
+ * to the descriptor from then on.
+ *
+ * @param[in] out output whose queue has been dropped
+ * @return 0 if the all-keys-up report was sent, -1 with errno set if not
+ */
+int hid_out_abort_fd(struct HidOut *out);
+
+/**
+ * Pauses output for a while. Synchronous backends sleep; asynchronous
+ * backends queue the pause behind the reports written so far and return.
+ *
+ * @param[in] out output to pause
+ * @param[in] ms milliseconds to pause for
+ * @return 0 on success, -1 with errno set if an earlier write failed
+ */
+int hid_out_delay(struct HidOut *out, long ms);
+
+/**
+ * Pauses output for a while, like hid_out_delay(), to the nanosecond.
+ *
+ * @param[in] out output to pause
+ * @param[in] ns nanoseconds to pause for
+ * @return 0 on success, -1 with errno set if an earlier write failed
+ */
+int hid_out_delay_ns(struct HidOut *out, long long ns);
+
+/**
+ * Waits until every report written has been sent, including any pauses
+ * queued in between.
+ *
+ * @param[in] out output to flush
+ * @return 0 on success, -1 with errno set if a write failed
+ */
+int hid_out_flush(struct HidOut *out);
+
+/**
+ * Closes an output and frees it. Reports still queued are sent first.
+ *
+ * @param[in] out output to close, may be NULL
+ */
+void hid_out_close(struct HidOut *out);
+
+/**
+ * Opens a file or gadget device for output through io_uring, like
+ * hid_out_open().
+ *
+ * Writes and pauses are queued to the kernel as one ordered chain and
+ * submitted with a single syscall per hid_out_write() or hid_out_delay()
+ * call; neither waits for the reports to go out, so the caller can encode
+ * ahead while the kernel types and sleeps. Needs Linux 5.17 or later.
+ *
+ * @param[in] path path to open
+ * @param[in] report_size length of each report, at most HID_OUT_MAX_REPORT
+ * @return the output, or NULL with errno set if the file cannot be opened
+ *  or io_uring is not available, in which case hid_out_open() should be
+ *  used instead
+ */
+struct HidOut *hid_out_open_uring(const char *path, size_t report_size);
+
+/**
+ * Wraps an open file descriptor for output through io_uring, like
+ * hid_out_fdopen(). The descriptor is switched to blocking mode, as
+ * io_uring fails writes to non-blocking descriptors instead of waiting.
+ *
+ * @param[in] fd file descriptor to write to
+ * @param[in] report_size length of each report, at most HID_OUT_MAX_REPORT
+ * @return the output, or NULL with errno set if io_uring is not available
+ */
+struct HidOut *hid_out_uring_fdopen(int fd, size_t report_size);
+
+/**
+ * Opens a file for a trace of the reports on a virtual clock, instead of
+ * sending them to a device. Files are appended to, and created if they do
+ * not exist.
+ *
+ * Nothing sleeps: pauses, and with a rate set reports, move the virtual
+ * clock forward, kept in the output's due field. Each report becomes a
+ * line of text holding the virtual time in milliseconds and the report in
+ * hex, such as "30000.000 02 00 04 00 00 00 00 00".
+ *
+ * @param[in] path path to open
+ * @param[in] report_size length of each report, at most HID_OUT_MAX_REPORT
+ * @return the output, or NULL with errno set on failure
+ */
+struct HidOut *hid_out_open_trace(const char *path, size_t report_size);
+
+/**
+ * Wraps an open file descriptor for a trace on a virtual clock, like
+ * hid_out_open_trace(). The descriptor is not closed by hid_out_close().
+ *
+ * @param[in] fd file descriptor to write to
+ * @param[in] report_size length of each report, at most HID_OUT_MAX_REPORT
+ * @return the output, or NULL with errno set on failure
+ */
+struct HidOut *hid_out_trace_fdopen(int fd, size_t report_size);
+
+/**
+ * Opens a capture file, in which reports are recorded instead of sent: each
+ * with the time it was sent at and the script line and command it came
+ * from, as set in the output's line and cmd fields. See capture.h for the
+ * format.
+ *
+ * A new file gets a header; an existing one is appended to if its header
+ * matches, so one file can collect several runs.
+ *
+ * @param[in] path path to open
+ * @param[in] report_size length of each report, at most CAPTURE_MAX_REPORT
+ * @param[in] virtual whether to record on a virtual clock, which pauses
+ *  move forward without sleeping, like a trace
+ * @return the output, or NULL with errno set on failure, EINVAL if the
+ *  file exists but is not a capture of the same kind
+ */
+struct HidOut *hid_out_open_capture(const char *path, size_t report_size,
+				    bool virtual);
+
+/**
+ * Wraps an open file descriptor for capture, like hid_out_open_capture().
+ * The descriptor is not closed by hid_out_close(); it has to be open for
+ * reading as well to append to an existing capture file.
+ *
+ * @param[in] fd file descriptor to write to
+ * @param[in] report_size length of each report, at most CAPTURE_MAX_REPORT
+ * @param[in] virtual whether to record on a virtual clock
+ * @return the output, or NULL with errno set on failure
+ */
+struct HidOut *hid_out_capture_fdopen(int fd, size_t report_size,
+				      bool virtual);
+
+/**
+ * Wraps an output in a pipeline: writes and pauses are queued for a writer
+ * thread, which hands them to the wrapped output while the caller goes on
+ * encoding. Like with io_uring, failures are returned by a later call, at
+ * the latest by hid_out_flush().
+ *
+ * Set the deadline and rate on the wrapped output before wrapping it. The pipeline
+ * takes over the wrapped output and closes it along with itself.
+ *
+ * @param[in] inner output to write to
+ * @return the pipeline, or NULL with errno set if the writer thread could
+ *  not be started, in which case inner is left as it was
+ */
+struct HidOut *hid_out_pipeline(struct HidOut *inner);
+
+/**
+ * Switches a file descriptor between blocking and non-blocking mode.
+ *
+ * @param[in] fd file descriptor to switch
+ * @param[in] blocking whether writes should block
+ * @return 0 on success, -1 with errno set on failure
+ */
+int set_blocking(int fd, bool blocking);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "kybdutil.h"
+#include <stdbool.h>
+
+/**
+ * Plans the reports that type out a sequence of key presses.
+ *
+ * Every report in the input describes the keys held down to produce one
+ * character. The output is the sequence of key states to send so that the
+ * host sees each of those presses in turn, ending with all keys up.
+ *
+ * Without eliding, every press is followed by an all-zero release report,
+ * which costs two reports per character. With eliding, the planner goes
+ * straight from one press to the next and only inserts a release where HID
+ * semantics require one:
+ *
+ *  - the next press repeats a key that is already down: the keys are
+ *    released first, keeping the modifiers held if they do not change
+ *  - the modifiers change: everything is released first, so that the host
+ *    never applies the new modifiers to the old keys or the other way round
+ *  - the next press is identical to the current state
+ *
+ * A run of characters that share modifiers, such as a run of capitals,
+ * therefore holds the modifiers for the whole run.
+ *
+ * @param[in] in key presses, as produced by encode_string()
+ * @param[out] out buffer to append the planned reports to, in the same
+ *  format as in
+ * @param[in] elide whether to elide releases that are not needed
+ * @return number of reports appended, or -1 if memory could not be allocated
+ *  or the formats differ
+ */
+ssize_t plan_reports(const struct ReportBuf *in, struct ReportBuf *out,
+		     bool elide);
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "kybdutil.h"
+#include "output.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * A script compiled to a stream of instructions.
+ *
+ * compile_script() reads, tokenizes and encodes a whole script up front, so
+ * that run_program() has nothing left to do but write reports and pause.
+ * Each instruction is an opcode byte followed by its operands, 32-bit
+ * integers in host byte order, not aligned.
+ */
+
+/** u32 n, then n reports: write the reports */
+#define OP_EMIT 1
+/** s32 ms: pause */
+#define OP_DELAY 2
+/** pause for the default delay */
+#define OP_DEFAULT_DELAY 3
+/** s32 ms: set the default delay */
+#define OP_SET_DEFAULT_DELAY 4
+/**
+ * u32 count, u32 start, u32 len: run the len bytes of code at offset start
+ * count times. Loops only go back to code before them, and the code they
+ * run holds no loops.
+ */
+#define OP_LOOP 5
+/** u32 line, u32 cmd: where the instructions that follow come from */
+#define OP_SOURCE 6
+/** u32 n, u32 len, then len bytes packing n reports: write the reports */
+#define OP_EMIT_PACKED 7
+
+/**
+ * Packed reports are a series of records. A record with a tag of at most
+ * the report size is a report, given as the tag count of (index, value)
+ * byte pairs it differs from the report before it in; the first report of
+ * an instruction differs from an empty report. A PACK_RUN tag is followed
+ * by a period p and a count c, one byte each, and stands for the c * p
+ * reports made by repeating the last p reports c times.
+ */
+#define PACK_RUN 0x80
+/** Longest stretch of reports a PACK_RUN repeats */
+#define PACK_MAX_PERIOD 16
+
+/** Program flag: releases were elided when encoding, as with -e */
+#define PROGRAM_ELIDED 1
+
+struct Program {
+	// report format, REPORT_BOOT or REPORT_NKRO
+	int format;
+	// size of each report in bytes
+	size_t report_size;
+	// PROGRAM_* flags
+	uint32_t flags;
+	// instructions
+	unsigned char *code;
+	// length of the code in bytes
+	size_t len;
+	// number of bytes the code has room for
+	size_t cap;
+	// mapped payload file holding the code, NULL if on the heap
+	void *image;
+	// length of the mapping at image
+	size_t image_len;
+};
+
+/**
+ * A compiled payload file (.akp) is a PayloadHeader followed by the code of
+ * a program, so that it can be run in place once it is mapped. Everything
+ * is in host byte order.
+ */
+#define PAYLOAD_MAGIC "AKPL"
+#define PAYLOAD_VERSION 1
+
+struct PayloadHeader {
+	// PAYLOAD_MAGIC, not null-terminated
+	char magic[4];
+	// PAYLOAD_VERSION
+	uint16_t version;
+	// report format, REPORT_BOOT or REPORT_NKRO
+	uint16_t format;
+	// PROGRAM_* flags
+	uint32_t flags;
+	uint32_t reserved;
+	// length of the code that follows
+	uint64_t code_len;
+};
+
+/**
+ * Initializes an empty program.
+ *
+ * @param[out] prog program to initialize
+ * @param[in] format format of the reports the program will hold
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int init_program(struct Program *prog, int format);
+
+/**
+ * Frees the memory held by a program, or unmaps it if it was mapped with
+ * map_program().
+ *
+ * @param[in] prog program to free
+ */
+void free_program(struct Program *prog);
+
+/**
+ * Writes a program out as a payload file.
+ *
+ * @param[in] prog program to write
+ * @param[in] fd file descriptor to write to
+ * @return 0 on success, -1 with errno set on failure
+ */
+int save_program(const struct Program *prog, int fd);
+
+/**
+ * Maps a payload file read-only, as a program to run in place. The file is
+ * checked with check_program() first.
+ *
+ * @param[in] fd file descriptor of the payload file
+ * @param[out] prog the mapped program, to free with free_program()
+ * @return 0 on success, -1 with errno set on failure, EINVAL if the file
+ *  is not a payload this version can run
+ */
+int map_program(int fd, struct Program *prog);
+
+/**
+ * Checks that every instruction of a program is whole, that packed reports
+ * unpack to what their instructions say, and that loops only go back to
+ * whole instructions before them, none of which is a loop.
+ *
+ * @param[in] prog program to check
+ * @return 0 if it is, -1 with errno set to EINVAL if not, or ENOMEM if
+ *  memory could not be allocated
+ */
+int check_program(const struct Program *prog);
+
+/**
+ * Compiles an ArmoryDuckyScript, appending it to a program. Every line is
+ * parsed and every report encoded here, so lines that cannot be parsed and
+ * characters that cannot be mapped are reported before a single report is
+ * sent.
+ *
+ * Lines are echoed to stdout as they are compiled. DEFAULT_DELAY updates
+ * the context's default delay.
+ *
+ * @param[in] ctx encoding context to encode with
+ * @param[in] scriptfile FILE pointer to script file
+ * @param[in] prog program to append to, in the context's report format
+ * @return the number of lines skipped and characters left out, or -1 with
+ *  errno set if the script could not be read, is not valid UTF-8 (EILSEQ)
+ *  or memory could not be allocated
+ */
+long compile_script(struct KbdCtx *ctx, FILE *scriptfile,
+		    struct Program *prog);
+
+/**
+ * Runs a compiled program, writing its reports to an output.
+ *
+ * @param[in] prog program to run
+ * @param[in] out output to write reports to
+ * @return 0 on success, -1 with errno set if the output failed or the
+ *  program is malformed
+ */
+int run_program(const struct Program *prog, struct HidOut *out);
+
+#endif
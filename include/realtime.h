@@ -0,0 +1,41 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+/** Priority used when real-time scheduling is asked for without one */
+#define RT_DEFAULT_PRIORITY 50
+/** Heap made resident up front, enough for the report buffers of long lines */
+#define RT_PREFAULT_HEAP (1 << 20)
+/** Stack made resident up front */
+#define RT_PREFAULT_STACK (256 << 10)
+
+/**
+ * Locks all memory of the process, now and in future, into RAM and faults
+ * in a stretch of heap and stack ahead of time, so that typing never waits
+ * on a page fault. Freed heap is kept instead of handed back to the
+ * kernel, which would make the next allocation fault again.
+ *
+ * Needs CAP_IPC_LOCK, or an RLIMIT_MEMLOCK large enough for the process.
+ *
+ * @return 0 on success, -1 with errno set if memory could not be locked
+ */
+int rt_lock_memory(void);
+
+/**
+ * Switches the calling thread to SCHED_FIFO. Threads it starts afterwards
+ * inherit the policy.
+ *
+ * @param[in] priority SCHED_FIFO priority, from 1 to 99
+ * @return 0 on success, -1 with errno set on failure
+ */
+int rt_set_priority(int priority);
+
+/**
+ * Pins the calling thread to a CPU. Threads it starts afterwards inherit
+ * the affinity.
+ *
+ * @param[in] cpu number of the CPU to run on
+ * @return 0 on success, -1 with errno set on failure
+ */
+int rt_pin_cpu(int cpu);
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef TYPE_H
 #define TYPE_H
 
+#include "kybdutil.h"
+#include "output.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -8,24 +11,73 @@
 #define DEFAULT_OUTPUT_FILE "/dev/hidg0"
 
 /** Error codes */
-#define ERR_USAGE "usage: ./type -s <script> -l <layout> [-o /dev/hidgX]"
+#define ERR_USAGE                                                              \
+	"usage: ./type (-s <script> (-l <layout> | -L <built-in layout>) "     \
+	"| --run <payload>) "                                                  \
+	"[-o /dev/hidgX] [-t <ms>] [-r <chars/s>] [-e] [-N] [-S] [-u] [-p] " \
+	"[--realtime[=<priority>]] [--cpu <n>] [--virtual] [--capture] "      \
+	"[--cache[=<dir>]]\n"                                                  \
+	"       ./type --compile <script> (-l <layout> | -L <built-in layout>) " \
+	"-O <payload> [-e] [-N]"
 #define ERR_INVALID_TOKEN "Invalid token, skipping line"
+#define ERR_UNTERMINATED_BLOCK "STRING_BLOCK without END_STRING, skipping it"
 #define ERR_NO_MAPPING "No mapping for character, skipping"
 #define ERR_CANNOT_WRITE_HID "Error writing HID report"
 #define ERR_CANNOT_OPEN_LAYOUTFILE "Error opening layout file"
 #define ERR_CANNOT_OPEN_OUTFILE "Error opening output file"
 #define ERR_CANNOT_OPEN_INFILE "Error opening script file"
 #define ERR_BAD_LAYOUTFILE "Bad layout file"
+#define ERR_UNKNOWN_LAYOUT "No built-in layout by that name"
 #define ERR_BAD_UNICODE "Indecipherable UTF-8 byte sequence"
+#define ERR_OUT_OF_MEMORY "Out of memory"
+#define ERR_NO_URING "io_uring not available, writing synchronously"
+#define ERR_HID_TIMEOUT "Host stopped reading HID reports"
+#define ERR_CANNOT_RELEASE_KEYS "Error releasing keys"
+#define ERR_CANNOT_LOCK_MEMORY "Cannot lock memory, page faults may delay typing"
+#define ERR_NO_REALTIME "Cannot switch to real-time scheduling"
+#define ERR_CANNOT_PIN_CPU "Cannot pin to CPU"
+#define ERR_CANNOT_OPEN_PAYLOAD "Error opening payload file"
+#define ERR_BAD_PAYLOAD "Not a payload file this version can run"
+#define ERR_CANNOT_WRITE_PAYLOAD "Error writing payload file"
+#define ERR_CANNOT_OPEN_CACHE "Error opening cache directory"
+#define ERR_CANNOT_STORE_CACHE "Cannot store compiled script in cache"
+#define ERR_COMPILE_ERRORS "Script has errors, not writing payload"
+#define ERR_CANNOT_READ_INFILE "Error reading script file"
+
+/** Exit status when the host stops reading; EX_TEMPFAIL, worth a retry */
+#define EXIT_TIMEOUT 75
+
+/**
+ * Displays error message and optionally exits with
+ * EXIT_FAILURE. Only for programs; see cli.c.
+ *
+ * @param message null-terminated error message
+ * @param perr whether to use perror() to print the message
+ * @param fatal whether this error should kill the program
+ */
+void err(const char *message, bool perr, bool fatal);
 
 /**
- * Writes the HID report followed by an empty report to the
- * specified file.
+ * Gives up after a failed write: sends an all-keys-up report, so that
+ * no key is left held down on the host, and exits. Exits with
+ * EXIT_TIMEOUT if the host stopped reading reports, and EXIT_FAILURE
+ * on any other error. Only for programs; see cli.c.
  *
- * @param[in] report the 8-byte HID report
- * @param[in] file file stream to write report to
+ * @param[in] out output that failed, with errno set by the failure
  */
-void write_report(char *report, FILE *file);
+void abort_output(struct HidOut *out);
+
+/**
+ * Reads a whole number from a command-line argument, all of which must be
+ * the number. Only for programs; see cli.c.
+ *
+ * @param[in] arg argument to read
+ * @param[in] min smallest number accepted
+ * @param[in] max largest number accepted
+ * @param[out] n the number
+ * @return 0 on success, -1 if the argument is not a number in range
+ */
+int parse_arg(const char *arg, long min, long max, long *n);
 
 /**
  * Maps ArmoryDuckyScript escape token to the corresponding escape
@@ -41,11 +93,18 @@ uint32_t map_escape(const char *token);
 
 /**
  * Parses and executes an ArmoryDuckyScript, writing generated
- * HID reports to the file descriptor specified.
+ * HID reports to the output specified.
+ *
+ * DEFAULT_DELAY updates the context's default delay.
  *
+ * @param[in] ctx encoding context to encode with
  * @param[in] scriptfile FILE pointer to script file
- * @param[in] outfile file stream to write generated reports to
+ * @param[in] out output to write generated reports to
+ * @return the number of lines skipped and characters left out, or -1 with
+ *  errno set if the script could not be compiled, in which case nothing is
+ *  written, or if the output failed, in which case an all-keys-up report
+ *  has been sent
  */
-void parse(FILE *scriptfile, FILE *outfile);
+long parse(struct KbdCtx *ctx, FILE *scriptfile, struct HidOut *out);
 
 #endif
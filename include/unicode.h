@@ -1,12 +1,18 @@
 #ifndef UNICODE_H
 #define UNICODE_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /**
  * Reads a single UTF-8 code sequence from a string and returns
  * its 32-bit Unicode codepoint.
  *
+ * Kept for reading single characters out of NUL-terminated strings;
+ * it returns 0 both for NUL and for invalid sequences. Use
+ * next_codepoint() or utf8_decode() on buffers of known length.
+ *
  * @param[in] string the UTF-8 encoded string to read from
  * @param[out] index pointer to integer specifying the index of
  *  the byte starting the UTF-8 code sequence. Upon return this
@@ -16,4 +22,45 @@
  */
 uint32_t getCodepoint(char *string, int *index);
 
+/**
+ * Reads a single UTF-8 code sequence from a buffer of known length.
+ * Unlike getCodepoint(), never reads past the end of the buffer and
+ * tells NUL apart from errors.
+ *
+ * @param[in] string the UTF-8 encoded buffer to read from
+ * @param[in] len length of the buffer in bytes
+ * @param[in,out] index index of the byte starting the code sequence; on
+ *  success, the index of the byte immediately following it
+ * @param[out] codepoint Unicode codepoint of the character
+ * @return 0 on success, -1 if the sequence is invalid or truncated
+ */
+int next_codepoint(const char *string, size_t len, size_t *index,
+		   uint32_t *codepoint);
+
+/**
+ * Checks that a buffer holds nothing but complete, valid UTF-8 code
+ * sequences. Runs of ASCII are skipped a block at a time.
+ *
+ * @param[in] string the buffer to check
+ * @param[in] len length of the buffer in bytes
+ * @param[out] error if not NULL, set to the offset of the first byte of
+ *  the first invalid or truncated sequence
+ * @return 0 if the buffer is valid, -1 otherwise
+ */
+int utf8_validate(const char *string, size_t len, size_t *error);
+
+/**
+ * Decodes a whole UTF-8 buffer into codepoints in one pass.
+ *
+ * @param[in] string the UTF-8 encoded buffer to decode
+ * @param[in] len length of the buffer in bytes
+ * @param[out] codepoints array with room for len codepoints
+ * @param[out] error if not NULL, set to the offset of the first byte of
+ *  the first invalid or truncated sequence
+ * @return number of codepoints decoded, or -1 if the buffer is not valid
+ *  UTF-8
+ */
+ssize_t utf8_decode(const char *string, size_t len, uint32_t *codepoints,
+		    size_t *error);
+
 #endif
@@ -0,0 +1,332 @@
+/*
+ * Vectorized encoder for runs of ASCII text.
+ *
+ * Each kernel looks characters up in the ASCII tables of the layout index
+ * and spreads the usage IDs and modifiers out into boot reports of the form
+ * {mod, 0, id, 0, 0, 0, 0, 0}. A character whose usage ID is 0 is either
+ * unmapped or not ASCII at all, and ends the run.
+ *
+ * The vector kernels always translate and store whole blocks. Reports past
+ * the end of the run are garbage, but lie within the len reports the caller
+ * made room for.
+ */
+
+#include "ascii.h"
+#include "kybdutil.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ASCII_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ASCII_NEON
+#endif
+
+typedef size_t (*ascii_kernel)(const struct LayoutIndex *index,
+			       const unsigned char *ascii, size_t len,
+			       char *reports);
+
+static size_t encode_ascii_scalar(const struct LayoutIndex *index,
+				  const unsigned char *ascii, size_t len,
+				  char *reports)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char ch = ascii[i];
+		if (ch >= LAYOUT_ASCII_SIZE || index->ascii_id[ch] == 0)
+			break;
+
+		char *report = reports + i * HID_REPORT_SIZE;
+		memset(report, 0, HID_REPORT_SIZE);
+		report[0] = index->ascii_mod[ch];
+		report[2] = index->ascii_id[ch];
+	}
+
+	return i;
+}
+
+#ifdef ASCII_X86
+/**
+ * Stores 16 boot reports built from 16 usage IDs and modifiers.
+ */
+static inline void store_reports_sse2(char *reports, __m128i ids,
+				      __m128i mods)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i *out = (__m128i *)reports;
+
+	for (int half = 0; half < 2; half++) {
+		__m128i m = half ? _mm_unpackhi_epi8(mods, zero)
+				 : _mm_unpacklo_epi8(mods, zero);
+		__m128i k = half ? _mm_unpackhi_epi8(ids, zero)
+				 : _mm_unpacklo_epi8(ids, zero);
+		// {mod, 0, id, 0} for four characters at a time
+		__m128i lo = _mm_unpacklo_epi16(m, k);
+		__m128i hi = _mm_unpackhi_epi16(m, k);
+
+		_mm_storeu_si128(out++, _mm_unpacklo_epi32(lo, zero));
+		_mm_storeu_si128(out++, _mm_unpackhi_epi32(lo, zero));
+		_mm_storeu_si128(out++, _mm_unpacklo_epi32(hi, zero));
+		_mm_storeu_si128(out++, _mm_unpackhi_epi32(hi, zero));
+	}
+}
+
+/*
+ * A shuffle looks up 16-entry tables, so the 128-entry ASCII tables are
+ * split by the high nibble of the character into 8 tables. Every table is
+ * looked up by the low nibble and the result kept where the high nibble
+ * matches; bytes >= 0x80 match no table and come out as 0.
+ */
+
+__attribute__((target("ssse3"))) static size_t
+encode_ascii_ssse3(const struct LayoutIndex *index, const unsigned char *ascii,
+		   size_t len, char *reports)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i idtab[8], modtab[8];
+	size_t done = 0;
+
+	for (int g = 0; g < 8; g++) {
+		idtab[g] = _mm_loadu_si128(
+			(const __m128i *)&index->ascii_id[g * 16]);
+		modtab[g] = _mm_loadu_si128(
+			(const __m128i *)&index->ascii_mod[g * 16]);
+	}
+
+	while (len - done >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(ascii + done));
+		__m128i lo = _mm_and_si128(v, nibble);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		__m128i ids = _mm_setzero_si128();
+		__m128i mods = _mm_setzero_si128();
+
+		for (int g = 0; g < 8; g++) {
+			__m128i sel = _mm_cmpeq_epi8(hi, _mm_set1_epi8(g));
+			ids = _mm_or_si128(
+				ids,
+				_mm_and_si128(sel, _mm_shuffle_epi8(idtab[g], lo)));
+			mods = _mm_or_si128(
+				mods, _mm_and_si128(
+					      sel, _mm_shuffle_epi8(modtab[g], lo)));
+		}
+
+		store_reports_sse2(reports + done * HID_REPORT_SIZE, ids, mods);
+
+		unsigned bad = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(ids, _mm_setzero_si128()));
+		if (bad)
+			return done + __builtin_ctz(bad);
+		done += 16;
+	}
+
+	return done;
+}
+
+__attribute__((target("avx2"))) static size_t
+encode_ascii_avx2(const struct LayoutIndex *index, const unsigned char *ascii,
+		  size_t len, char *reports)
+{
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i idtab[8], modtab[8];
+	size_t done = 0;
+
+	// shuffles stay within 128-bit lanes, so each lane gets the table
+	for (int g = 0; g < 8; g++) {
+		idtab[g] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+			(const __m128i *)&index->ascii_id[g * 16]));
+		modtab[g] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+			(const __m128i *)&index->ascii_mod[g * 16]));
+	}
+
+	while (len - done >= 32) {
+		__m256i v =
+			_mm256_loadu_si256((const __m256i *)(ascii + done));
+		__m256i lo = _mm256_and_si256(v, nibble);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+		__m256i ids = _mm256_setzero_si256();
+		__m256i mods = _mm256_setzero_si256();
+
+		for (int g = 0; g < 8; g++) {
+			__m256i sel =
+				_mm256_cmpeq_epi8(hi, _mm256_set1_epi8(g));
+			ids = _mm256_or_si256(
+				ids, _mm256_and_si256(
+					     sel, _mm256_shuffle_epi8(idtab[g], lo)));
+			mods = _mm256_or_si256(
+				mods,
+				_mm256_and_si256(
+					sel, _mm256_shuffle_epi8(modtab[g], lo)));
+		}
+
+		char *out = reports + done * HID_REPORT_SIZE;
+		store_reports_sse2(out, _mm256_castsi256_si128(ids),
+				   _mm256_castsi256_si128(mods));
+		store_reports_sse2(out + 16 * HID_REPORT_SIZE,
+				   _mm256_extracti128_si256(ids, 1),
+				   _mm256_extracti128_si256(mods, 1));
+
+		unsigned bad = _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(ids, _mm256_setzero_si256()));
+		if (bad)
+			return done + __builtin_ctz(bad);
+		done += 32;
+	}
+
+	return done;
+}
+#endif
+
+#ifdef ASCII_NEON
+/**
+ * Looks up 8 characters in a 128-entry table split into four 32-byte
+ * tables. Indices outside a table leave the lane alone, and bytes >= 0x80
+ * fall outside all of them, so they come out as 0.
+ */
+static inline uint8x8_t lookup_neon(const uint8x8x4_t tab[4], uint8x8_t v)
+{
+	uint8x8_t r = vtbl4_u8(tab[0], v);
+
+	r = vtbx4_u8(r, tab[1], vsub_u8(v, vdup_n_u8(32)));
+	r = vtbx4_u8(r, tab[2], vsub_u8(v, vdup_n_u8(64)));
+	return vtbx4_u8(r, tab[3], vsub_u8(v, vdup_n_u8(96)));
+}
+
+/**
+ * Stores 8 boot reports built from 8 usage IDs and modifiers.
+ */
+static inline void store_reports_neon(char *reports, uint8x8_t ids,
+				      uint8x8_t mods)
+{
+	const uint8x8_t zero = vdup_n_u8(0);
+	uint8x8x2_t m = vzip_u8(mods, zero);
+	uint8x8x2_t k = vzip_u8(ids, zero);
+
+	for (int half = 0; half < 2; half++) {
+		// {mod, 0, id, 0} for two characters at a time
+		uint16x4x2_t mk = vzip_u16(vreinterpret_u16_u8(m.val[half]),
+					   vreinterpret_u16_u8(k.val[half]));
+
+		for (int i = 0; i < 2; i++) {
+			uint32x2x2_t r = vzip_u32(vreinterpret_u32_u16(mk.val[i]),
+						  vdup_n_u32(0));
+			vst1_u8((uint8_t *)reports,
+				vreinterpret_u8_u32(r.val[0]));
+			vst1_u8((uint8_t *)reports + HID_REPORT_SIZE,
+				vreinterpret_u8_u32(r.val[1]));
+			reports += 2 * HID_REPORT_SIZE;
+		}
+	}
+}
+
+static size_t encode_ascii_neon(const struct LayoutIndex *index,
+				const unsigned char *ascii, size_t len,
+				char *reports)
+{
+	uint8x8x4_t idtab[4], modtab[4];
+	size_t done = 0;
+
+	for (int t = 0; t < 4; t++) {
+		for (int i = 0; i < 4; i++) {
+			idtab[t].val[i] = vld1_u8(&index->ascii_id[t * 32 + i * 8]);
+			modtab[t].val[i] =
+				vld1_u8(&index->ascii_mod[t * 32 + i * 8]);
+		}
+	}
+
+	while (len - done >= 16) {
+		for (int half = 0; half < 2; half++) {
+			uint8x8_t v = vld1_u8(ascii + done);
+			uint8x8_t ids = lookup_neon(idtab, v);
+			uint8x8_t mods = lookup_neon(modtab, v);
+
+			store_reports_neon(reports + done * HID_REPORT_SIZE, ids,
+					   mods);
+
+			uint64_t bad = vget_lane_u64(
+				vreinterpret_u64_u8(vceq_u8(ids, vdup_n_u8(0))), 0);
+			if (bad)
+				return done + __builtin_ctzll(bad) / 8;
+			done += 8;
+		}
+	}
+
+	return done;
+}
+#endif
+
+/**
+ * Returns the kernel for one of the ASCII_KERNEL_* constants, or NULL if
+ * the CPU does not support it.
+ */
+static ascii_kernel find_kernel(int kernel)
+{
+#ifdef ASCII_X86
+	__builtin_cpu_init();
+#endif
+
+	switch (kernel) {
+	case ASCII_KERNEL_AUTO:
+#ifdef ASCII_X86
+		if (__builtin_cpu_supports("avx2"))
+			return encode_ascii_avx2;
+		if (__builtin_cpu_supports("ssse3"))
+			return encode_ascii_ssse3;
+#endif
+#ifdef ASCII_NEON
+		return encode_ascii_neon;
+#endif
+		return encode_ascii_scalar;
+	case ASCII_KERNEL_SCALAR:
+		return encode_ascii_scalar;
+#ifdef ASCII_X86
+	case ASCII_KERNEL_SSSE3:
+		if (__builtin_cpu_supports("ssse3"))
+			return encode_ascii_ssse3;
+		break;
+	case ASCII_KERNEL_AVX2:
+		if (__builtin_cpu_supports("avx2"))
+			return encode_ascii_avx2;
+		break;
+#endif
+#ifdef ASCII_NEON
+	case ASCII_KERNEL_NEON:
+		return encode_ascii_neon;
+#endif
+	}
+
+	return NULL;
+}
+
+/** Kernel in use, picked on first use unless selected */
+static ascii_kernel active_kernel;
+
+int select_ascii_kernel(int kernel)
+{
+	ascii_kernel found = find_kernel(kernel);
+
+	if (found == NULL)
+		return -1;
+
+	__atomic_store_n(&active_kernel, found, __ATOMIC_RELAXED);
+	return 0;
+}
+
+size_t encode_ascii(const struct LayoutIndex *index, const char *ascii,
+		    size_t len, char *reports)
+{
+	ascii_kernel kernel = __atomic_load_n(&active_kernel, __ATOMIC_RELAXED);
+
+	if (kernel == NULL) {
+		kernel = find_kernel(ASCII_KERNEL_AUTO);
+		__atomic_store_n(&active_kernel, kernel, __ATOMIC_RELAXED);
+	}
+
+	const unsigned char *s = (const unsigned char *)ascii;
+	size_t done = kernel(index, s, len, reports);
+
+	// the vector kernels leave a tail shorter than a block
+	return done + encode_ascii_scalar(index, s + done, len - done,
+					  reports + done * HID_REPORT_SIZE);
+}
@@ -0,0 +1,18 @@
+/*
+ * Access to the layouts built into the program. The images themselves are
+ * generated by layoutc into builtin_layouts.c at build time.
+ */
+
+#include "layouts.h"
+#include <string.h>
+
+struct Layout *load_builtin_layout(const char *name)
+{
+	for (int i = 0; builtin_layouts[i].name != NULL; i++) {
+		if (!strcmp(builtin_layouts[i].name, name))
+			return open_layout_image(builtin_layouts[i].image,
+						 builtin_layouts[i].len);
+	}
+
+	return NULL;
+}
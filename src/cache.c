@@ -0,0 +1,335 @@
+/*
+ * On-disk cache of compiled scripts.
+ */
+
+#include "cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Suffix of payload files in the cache */
+#define CACHE_SUFFIX ".akp"
+/** File holding the hit and miss counters */
+#define CACHE_STATS "stats"
+/** Prefix of the files payloads are written to before they are renamed */
+#define CACHE_TMP ".tmp-"
+/**
+ * Temporary files untouched for this many seconds were left by runs that
+ * died while storing
+ */
+#define CACHE_STALE_TMP_SEC 600
+
+/**
+ * A payload in the cache, as seen when evicting.
+ */
+struct CacheEntry {
+	char name[CACHE_KEY_LEN + sizeof(CACHE_SUFFIX)];
+	off_t size;
+	struct timespec mtime;
+};
+
+static void fnv1a(uint64_t *hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		*hash ^= p[i];
+		*hash *= 1099511628211u;
+	}
+}
+
+void init_cache_key(struct CacheKey *key, const struct KbdCtx *ctx)
+{
+	init_cache_key_version(key, ctx, ENCODER_VERSION);
+}
+
+void init_cache_key_version(struct CacheKey *key, const struct KbdCtx *ctx,
+			    uint32_t version)
+{
+	const uint32_t options[] = {version, PAYLOAD_VERSION,
+				     ctx->format, ctx->elide_releases,
+				     ctx->defdelay};
+
+	key->hash = 14695981039346656037u;
+	fnv1a(&key->hash, options, sizeof(options));
+}
+
+void add_cache_key(struct CacheKey *key, const void *data, size_t len)
+{
+	uint64_t n = len;
+
+	// keep the boundary between one piece and the next
+	fnv1a(&key->hash, &n, sizeof(n));
+	fnv1a(&key->hash, data, len);
+}
+
+int add_cache_key_file(struct CacheKey *key, FILE *file)
+{
+	char buf[8192];
+	uint64_t hash = key->hash, len = 0;
+	size_t n;
+
+	// the length goes last, as it is only known at the end
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+		fnv1a(&hash, buf, n);
+		len += n;
+	}
+	if (ferror(file) || fseek(file, 0, SEEK_SET))
+		return -1;
+
+	fnv1a(&hash, &len, sizeof(len));
+	key->hash = hash;
+	return 0;
+}
+
+/**
+ * Builds the path of a file in the cache directory.
+ */
+static int cache_path(const struct ScriptCache *cache, const char *name,
+		      char *path)
+{
+	if (snprintf(path, PATH_MAX, "%s/%s", cache->dir, name) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void key_name(const struct CacheKey *key, char *name)
+{
+	sprintf(name, "%016llx" CACHE_SUFFIX, (unsigned long long)key->hash);
+}
+
+/**
+ * Creates a directory along with any parents it is missing.
+ */
+static int make_dirs(char *path)
+{
+	for (char *p = path + 1; *p != '\0'; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		int ret = mkdir(path, 0700);
+		*p = '/';
+		if (ret && errno != EEXIST)
+			return -1;
+	}
+
+	return mkdir(path, 0700) && errno != EEXIST ? -1 : 0;
+}
+
+/**
+ * Deletes temporary files left behind by runs that died while storing,
+ * leaving those that other runs may still be writing.
+ */
+static void sweep_tmp(struct ScriptCache *cache)
+{
+	struct timespec now;
+	struct dirent *de;
+
+	DIR *dir = opendir(cache->dir);
+	if (dir == NULL)
+		return;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	while ((de = readdir(dir)) != NULL) {
+		struct stat st;
+
+		if (strncmp(de->d_name, CACHE_TMP, strlen(CACHE_TMP)) == 0
+		    && fstatat(dirfd(dir), de->d_name, &st, 0) == 0
+		    && now.tv_sec - st.st_mtim.tv_sec > CACHE_STALE_TMP_SEC)
+			unlinkat(dirfd(dir), de->d_name, 0);
+	}
+
+	closedir(dir);
+}
+
+int open_cache(struct ScriptCache *cache, const char *dir, size_t max_size)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	int len;
+
+	if (dir != NULL)
+		len = snprintf(cache->dir, PATH_MAX, "%s", dir);
+	else if (base != NULL && base[0] != '\0')
+		len = snprintf(cache->dir, PATH_MAX, "%s/armorykbd", base);
+	else if ((base = getenv("HOME")) != NULL)
+		len = snprintf(cache->dir, PATH_MAX, "%s/.cache/armorykbd",
+			       base);
+	else {
+		errno = ENOENT;
+		return -1;
+	}
+	if (len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	cache->max_size = max_size;
+	cache->hits = cache->misses = 0;
+	if (make_dirs(cache->dir))
+		return -1;
+
+	sweep_tmp(cache);
+	return 0;
+}
+
+/**
+ * Counts a lookup in the counters file, which is shared by every run using
+ * the directory, and reads the counters back.
+ */
+static void count_lookup(struct ScriptCache *cache, bool hit)
+{
+	char path[PATH_MAX];
+	uint64_t counts[2] = {0, 0};
+
+	if (cache_path(cache, CACHE_STATS, path))
+		return;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	if (flock(fd, LOCK_EX) == 0) {
+		if (pread(fd, counts, sizeof(counts), 0) != sizeof(counts))
+			memset(counts, 0, sizeof(counts));
+		counts[hit ? 0 : 1]++;
+		if (pwrite(fd, counts, sizeof(counts), 0) == sizeof(counts)) {
+			cache->hits = counts[0];
+			cache->misses = counts[1];
+		}
+	}
+	close(fd);
+}
+
+int load_cached(struct ScriptCache *cache, const struct CacheKey *key,
+		struct Program *prog)
+{
+	char name[CACHE_KEY_LEN + sizeof(CACHE_SUFFIX)];
+	char path[PATH_MAX];
+	int fd = -1;
+
+	key_name(key, name);
+	if (cache_path(cache, name, path)
+	    || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0
+	    || map_program(fd, prog)) {
+		int saved = errno;
+		if (fd >= 0)
+			close(fd);
+		count_lookup(cache, false);
+		errno = saved;
+		return -1;
+	}
+
+	// mark it as used, for eviction
+	futimens(fd, NULL);
+	close(fd);
+	count_lookup(cache, true);
+	return 0;
+}
+
+static int older(const void *a, const void *b)
+{
+	const struct timespec *x = &((const struct CacheEntry *)a)->mtime;
+	const struct timespec *y = &((const struct CacheEntry *)b)->mtime;
+
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	if (x->tv_nsec != y->tv_nsec)
+		return x->tv_nsec < y->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Deletes the least recently used payloads until the rest fit under the
+ * size cap.
+ */
+static int evict(struct ScriptCache *cache)
+{
+	struct CacheEntry *entries = NULL;
+	size_t n = 0, cap = 0;
+	off_t total = 0;
+	struct dirent *de;
+
+	DIR *dir = opendir(cache->dir);
+	if (dir == NULL)
+		return -1;
+
+	while ((de = readdir(dir)) != NULL) {
+		size_t len = strlen(de->d_name);
+		struct stat st;
+
+		// only payloads, not temporary files or the counters
+		if (len != CACHE_KEY_LEN + strlen(CACHE_SUFFIX)
+		    || strcmp(de->d_name + CACHE_KEY_LEN, CACHE_SUFFIX) != 0
+		    || fstatat(dirfd(dir), de->d_name, &st, 0))
+			continue;
+
+		if (n == cap) {
+			cap = cap ? 2 * cap : 64;
+			struct CacheEntry *grown =
+				realloc(entries, cap * sizeof(*entries));
+			if (grown == NULL) {
+				free(entries);
+				closedir(dir);
+				return -1;
+			}
+			entries = grown;
+		}
+		memcpy(entries[n].name, de->d_name, len + 1);
+		entries[n].size = st.st_size;
+		entries[n].mtime = st.st_mtim;
+		total += st.st_size;
+		n++;
+	}
+
+	if (total > (off_t)cache->max_size) {
+		qsort(entries, n, sizeof(*entries), older);
+		for (size_t i = 0; i < n && total > (off_t)cache->max_size;
+		     i++)
+			if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+				total -= entries[i].size;
+	}
+
+	free(entries);
+	closedir(dir);
+	return 0;
+}
+
+int store_cached(struct ScriptCache *cache, const struct CacheKey *key,
+		 const struct Program *prog)
+{
+	char name[CACHE_KEY_LEN + sizeof(CACHE_SUFFIX)];
+	char tmp[PATH_MAX], path[PATH_MAX];
+
+	key_name(key, name);
+	if (cache_path(cache, name, path)
+	    || cache_path(cache, CACHE_TMP "XXXXXX", tmp))
+		return -1;
+
+	// write it under a temporary name and rename it into place, so that
+	// readers find either the whole payload or none of it
+	int fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	int ret = save_program(prog, fd) || fsync(fd) ? -1 : 0;
+	if (close(fd))
+		ret = -1;
+	if (ret == 0 && rename(tmp, path))
+		ret = -1;
+	if (ret) {
+		int saved = errno;
+		unlink(tmp);
+		errno = saved;
+		return -1;
+	}
+
+	return evict(cache);
+}
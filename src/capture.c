@@ -0,0 +1,67 @@
+/*
+ * Capture file format.
+ */
+
+#include "capture.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void init_capture_header(struct CaptureHeader *header, size_t report_size,
+			 uint32_t flags)
+{
+	memset(header, 0, sizeof(struct CaptureHeader));
+	memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+	header->version = CAPTURE_VERSION;
+	header->report_size = report_size;
+	header->record_size = capture_record_size(report_size);
+	header->flags = flags;
+}
+
+int check_capture_header(const struct CaptureHeader *header)
+{
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0
+	    || header->version != CAPTURE_VERSION
+	    || header->report_size == 0
+	    || header->report_size > CAPTURE_MAX_REPORT
+	    || header->record_size != capture_record_size(header->report_size)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int map_capture(int fd, struct Capture *cap)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+	if ((size_t)st.st_size < sizeof(struct CaptureHeader)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	cap->header = map;
+	cap->len = st.st_size;
+	if (check_capture_header(cap->header)) {
+		munmap(map, cap->len);
+		return -1;
+	}
+
+	cap->records = (const char *)map + sizeof(struct CaptureHeader);
+	cap->count = (cap->len - sizeof(struct CaptureHeader))
+		     / cap->header->record_size;
+	return 0;
+}
+
+void unmap_capture(struct Capture *cap)
+{
+	munmap((void *)cap->header, cap->len);
+}
@@ -0,0 +1,59 @@
+/*
+ * Error reporting and argument parsing shared by the type and replay
+ * programs. The error reporting exits, so it is not part of the library:
+ * library functions return errors for their caller to report.
+ */
+
+#include "type.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Displays error message and optionally exits with
+ * EXIT_FAILURE.
+ *
+ * @param message null-terminated error message
+ * @param perr whether to use perror() to print the message
+ * @param fatal whether this error should kill the program
+ */
+void err(const char *message, bool perr, bool fatal)
+{
+	char *prefix = fatal ? "[X]" : "[!]";
+
+	if (perr) {
+		fprintf(stderr, "%s ", prefix);
+		perror(message);
+	} else {
+		fprintf(stderr, "%s %s\n", prefix, message);
+	}
+
+	if (fatal)
+		exit(EXIT_FAILURE);
+}
+
+void abort_output(struct HidOut *out)
+{
+	int error = errno;
+	bool timeout = error == ETIMEDOUT;
+
+	err(timeout ? ERR_HID_TIMEOUT : ERR_CANNOT_WRITE_HID, !timeout, false);
+	if (hid_out_abort(out))
+		err(ERR_CANNOT_RELEASE_KEYS, true, false);
+
+	exit(timeout ? EXIT_TIMEOUT : EXIT_FAILURE);
+}
+
+int parse_arg(const char *arg, long min, long max, long *n)
+{
+	char *end;
+
+	errno = 0;
+	long value = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno == ERANGE || value < min
+	    || value > max)
+		return -1;
+
+	*n = value;
+	return 0;
+}
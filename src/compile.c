@@ -0,0 +1,667 @@
+/*
+ * Compiles scripts into programs for the VM in vm.c.
+ */
+
+#include "program.h"
+#include "keywords.h"
+#include "planner.h"
+#include "type.h"
+#include "unicode.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Makes room for more code, doubling the program's capacity as needed.
+ *
+ * @param prog program to grow
+ * @param n number of bytes about to be appended
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int reserve(struct Program *prog, size_t n)
+{
+	size_t cap = prog->cap;
+
+	while (cap - prog->len < n)
+		cap *= 2;
+	if (cap == prog->cap)
+		return 0;
+
+	unsigned char *code = realloc(prog->code, cap);
+	if (code == NULL)
+		return -1;
+	prog->code = code;
+	prog->cap = cap;
+	return 0;
+}
+
+static int emit_op(struct Program *prog, unsigned char op)
+{
+	if (reserve(prog, 1))
+		return -1;
+	prog->code[prog->len++] = op;
+	return 0;
+}
+
+static int emit_u32(struct Program *prog, uint32_t n)
+{
+	if (reserve(prog, sizeof(n)))
+		return -1;
+	memcpy(prog->code + prog->len, &n, sizeof(n));
+	prog->len += sizeof(n);
+	return 0;
+}
+
+/**
+ * Counts how many reports from i on repeat the period reports before them.
+ */
+static size_t match_period(const char *reports, size_t n, size_t size,
+			   size_t i, size_t period)
+{
+	size_t len = 0;
+
+	while (i + len < n
+	       && memcmp(reports + (i + len) * size,
+			 reports + (i + len - period) * size, size) == 0)
+		len++;
+
+	return len;
+}
+
+/**
+ * Packs a run of reports as described in program.h.
+ *
+ * @param reports reports to pack
+ * @param n number of reports
+ * @param size size of each report
+ * @param packed where to store the packed reports, with room for n times
+ *  1 + 2 * size bytes
+ * @return length of the packed reports
+ */
+static size_t pack_reports(const char *reports, size_t n, size_t size,
+			   unsigned char *packed)
+{
+	static const char empty[MAX_REPORT_SIZE];
+	unsigned char *p = packed;
+	size_t i = 0;
+
+	while (i < n) {
+		// find the period repeating the most reports, and use it if
+		// the run takes fewer bytes than the reports would
+		size_t best = 0, best_len = 0;
+		for (size_t period = 1; period <= PACK_MAX_PERIOD && period <= i;
+		     period++) {
+			size_t len = match_period(reports, n, size, i, period);
+			len -= len % period;
+			if (len > best_len) {
+				best = period;
+				best_len = len;
+			}
+		}
+
+		if (best_len >= 2) {
+			size_t count = best_len / best;
+			if (count > UINT8_MAX)
+				count = UINT8_MAX;
+			*p++ = PACK_RUN;
+			*p++ = best;
+			*p++ = count;
+			i += count * best;
+			continue;
+		}
+
+		const char *prev = i > 0 ? reports + (i - 1) * size : empty;
+		const char *report = reports + i * size;
+		unsigned char *tag = p++;
+
+		*tag = 0;
+		for (size_t b = 0; b < size; b++) {
+			if (report[b] != prev[b]) {
+				*p++ = b;
+				*p++ = report[b];
+				(*tag)++;
+			}
+		}
+		i++;
+	}
+
+	return p - packed;
+}
+
+/**
+ * Appends an instruction writing a run of reports, packed where that makes
+ * it shorter.
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int emit_reports(struct Program *prog, const char *reports, size_t n)
+{
+	size_t size = prog->report_size;
+	size_t header = 1 + 2 * sizeof(uint32_t);
+
+	// pack straight into the code, and fall back on the plain reports
+	// if they come out shorter; the room reserved covers both
+	if (reserve(prog, header + n * (1 + 2 * size)))
+		return -1;
+	size_t len = pack_reports(reports, n, size,
+				  prog->code + prog->len + header);
+	if (len < n * size) {
+		emit_op(prog, OP_EMIT_PACKED);
+		emit_u32(prog, n);
+		emit_u32(prog, len);
+		prog->len += len;
+		return 0;
+	}
+
+	emit_op(prog, OP_EMIT);
+	emit_u32(prog, n);
+	memcpy(prog->code + prog->len, reports, n * size);
+	prog->len += n * size;
+	return 0;
+}
+
+/**
+ * Appends an instruction writing a report followed by an empty report,
+ * and clears the report.
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int emit_report(struct Program *prog, char *report)
+{
+	char pair[2 * MAX_REPORT_SIZE] = {0};
+
+	memcpy(pair, report, prog->report_size);
+	memset(report, 0x0, prog->report_size);
+	return emit_reports(prog, pair, 2);
+}
+
+/**
+ * A stretch of the script, not null-terminated.
+ */
+struct Span {
+	const char *p;
+	size_t len;
+};
+
+/**
+ * A script in memory: mapped from its file where it can be, read into a
+ * buffer where it cannot, as from a pipe.
+ */
+struct Script {
+	struct Span text;
+	// mapping holding the text, NULL if in a buffer
+	void *map;
+	// length of the mapping
+	size_t map_len;
+	// buffer holding the text, NULL if mapped
+	char *buf;
+};
+
+/**
+ * Brings a script into memory, from the file's current position on.
+ *
+ * @param file script file
+ * @param script the script in memory
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int open_script(FILE *file, struct Script *script)
+{
+	struct stat st;
+	int fd = fileno(file);
+	off_t pos;
+
+	memset(script, 0, sizeof(struct Script));
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	    && st.st_size > 0 && (pos = ftello(file)) >= 0
+	    && pos <= st.st_size) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+				 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			script->map = map;
+			script->map_len = st.st_size;
+			script->text.p = (const char *)map + pos;
+			script->text.len = st.st_size - pos;
+			return 0;
+		}
+	}
+
+	size_t cap = 0, n;
+	do {
+		if (script->text.len == cap) {
+			cap = cap ? 2 * cap : 65536;
+			char *grown = realloc(script->buf, cap);
+			if (grown == NULL) {
+				free(script->buf);
+				return -1;
+			}
+			script->buf = grown;
+		}
+		n = fread(script->buf + script->text.len, 1,
+			  cap - script->text.len, file);
+		script->text.len += n;
+	} while (n > 0);
+
+	script->text.p = script->buf;
+	return ferror(file) ? -1 : 0;
+}
+
+static void close_script(struct Script *script)
+{
+	if (script->map != NULL)
+		munmap(script->map, script->map_len);
+	free(script->buf);
+}
+
+/**
+ * Cuts the next line, newline included, off the rest of the script.
+ */
+static struct Span next_line(struct Span *rest)
+{
+	struct Span line = {rest->p, rest->len};
+	const char *nl = memchr(rest->p, '\n', rest->len);
+
+	if (nl != NULL)
+		line.len = nl - rest->p + 1;
+	rest->p += line.len;
+	rest->len -= line.len;
+	return line;
+}
+
+static bool is_delim(char c)
+{
+	return c == ' ' || c == '\n';
+}
+
+/**
+ * Cuts the next token off the rest of a line, along with the delimiter
+ * after it, as strtok() would.
+ *
+ * @return the token, empty if there is none
+ */
+static struct Span next_token(struct Span *rest)
+{
+	struct Span tok;
+
+	while (rest->len > 0 && is_delim(*rest->p)) {
+		rest->p++;
+		rest->len--;
+	}
+
+	tok.p = rest->p;
+	for (tok.len = 0; tok.len < rest->len && !is_delim(tok.p[tok.len]);
+	     tok.len++)
+		;
+
+	size_t skip = tok.len < rest->len ? tok.len + 1 : tok.len;
+	rest->p += skip;
+	rest->len -= skip;
+	return tok;
+}
+
+/**
+ * Reads the numeric argument of a command, a decimal number no greater
+ * than a bound.
+ *
+ * @param rest rest of the line
+ * @param max largest number allowed
+ * @param n where to store the number
+ * @return 0 on success, -1 if there is no number or it is out of range
+ */
+static int parse_number(struct Span *rest, uint32_t max, long *n)
+{
+	struct Span tok = next_token(rest);
+	uint32_t value = 0;
+	size_t i = 0;
+
+	if (i < tok.len && tok.p[i] == '+')
+		i++;
+	if (i == tok.len || !isdigit((unsigned char)tok.p[i]))
+		return -1;
+	for (; i < tok.len && isdigit((unsigned char)tok.p[i]); i++) {
+		uint32_t digit = tok.p[i] - '0';
+		if (value > (max - digit) / 10)
+			return -1;
+		value = value * 10 + digit;
+	}
+
+	*n = value;
+	return 0;
+}
+
+/**
+ * Warns about a line or character that is left out of a program.
+ */
+static void warn(const char *message)
+{
+	fprintf(stderr, "[!] %s\n", message);
+}
+
+/**
+ * Encodes text, appending it to a report buffer, and warns about
+ * characters the layout has no mapping for.
+ *
+ * @param nerrors count of characters left out, added to
+ * @return 0 on success, -1 with errno set if the text is not valid UTF-8
+ *  or memory could not be allocated
+ */
+static int encode_text(struct KbdCtx *ctx, struct Span text,
+		       struct ReportBuf *buf, long *nerrors)
+{
+	size_t first = buf->nerrors;
+
+	if (encode_string(ctx, text.p, text.len, buf) == -1)
+		return -1;
+
+	for (size_t i = first; i < buf->nerrors; i++) {
+		uint32_t codepoint = buf->errors[i].codepoint;
+		char message[64];
+		snprintf(message, sizeof(message),
+			 "No mapping for character: %c (U+%04x)", codepoint,
+			 codepoint);
+		warn(message);
+	}
+
+	*nerrors += buf->nerrors - first;
+	return 0;
+}
+
+/**
+ * Tells whether a line ends a STRING_BLOCK.
+ */
+static bool is_block_end(struct Span line)
+{
+	struct Span tok = next_token(&line);
+	const struct Keyword *kw = lookup_keyword(tok.p, tok.len);
+
+	return kw != NULL && kw->type == KW_COMMAND
+	       && kw->value == CMD_END_STRING;
+}
+
+long compile_script(struct KbdCtx *ctx, FILE *scriptfile,
+		    struct Program *prog)
+{
+	char report[MAX_REPORT_SIZE];
+	struct Script script;
+	struct ReportBuf strbuf, planbuf;
+	unsigned long lineno = 0;
+	long nerrors = 0;
+	// code of the last command, for REPEAT
+	size_t last_start = 0, last_len = 0;
+	int error;
+
+	int format = prog->format;
+
+	if (open_script(scriptfile, &script))
+		return -1;
+	// both are initialized, so that both can be freed
+	bool nomem = init_report_buf(&strbuf, format, 512) != 0;
+	if (init_report_buf(&planbuf, format, 2 * 512))
+		nomem = true;
+	if (nomem)
+		goto fail;
+
+	if (ctx->elide_releases)
+		prog->flags |= PROGRAM_ELIDED;
+	if (ctx->defdelay != 0
+	    && (emit_op(prog, OP_SET_DEFAULT_DELAY)
+		|| emit_u32(prog, ctx->defdelay)))
+		goto fail;
+
+	// loop over lines in the script, however long they are, reading
+	// them where they lie
+	struct Span rest = script.text;
+	while (rest.len > 0) {
+		struct Span line = next_line(&rest);
+		lineno++;
+
+		if (line.len > 1)
+			fwrite(line.p, 1, line.len, stdout);
+
+		struct Span command = next_token(&line);
+		if (command.len == 0)
+			continue;
+
+		const struct Keyword *kw = lookup_keyword(command.p, command.len);
+		if (kw == NULL) {
+			warn(ERR_INVALID_TOKEN);
+			nerrors++;
+			continue;
+		}
+
+		int cmd = kw->type == KW_ESCAPE ? CMD_KEY : kw->value;
+		if (cmd == CMD_REM)
+			continue;
+
+		if (cmd == CMD_REPEAT) {
+			long count;
+			if (parse_number(&line, UINT32_MAX, &count)
+			    || last_len == 0) {
+				warn(ERR_INVALID_TOKEN);
+				nerrors++;
+				continue;
+			}
+
+			if (emit_op(prog, OP_LOOP) || emit_u32(prog, count)
+			    || emit_u32(prog, last_start)
+			    || emit_u32(prog, last_len))
+				goto fail;
+			continue;
+		}
+
+		// tell outputs that record it where the reports come from
+		size_t start = prog->len;
+		if (emit_op(prog, OP_SOURCE) || emit_u32(prog, lineno)
+		    || emit_u32(prog, cmd))
+			goto fail;
+
+		// clear HID report
+		memset(report, 0x0, sizeof(report));
+
+		switch (cmd) {
+		case CMD_KEY:
+			// a bare escape token is pressed on its own
+			if (make_hid_report(ctx, report, 1, 1, kw->value)) {
+				warn(ERR_NO_MAPPING);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+			if (emit_report(prog, report))
+				goto fail;
+			break;
+		case CMD_DEFAULT_DELAY:
+			// delays are signed 32-bit operands
+			if (parse_number(&line, INT32_MAX, &ctx->defdelay)) {
+				warn(ERR_INVALID_TOKEN);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+			if (emit_op(prog, OP_SET_DEFAULT_DELAY)
+			    || emit_u32(prog, ctx->defdelay))
+				goto fail;
+			last_start = start;
+			last_len = prog->len - start;
+			continue;
+		case CMD_DELAY: {
+			long delay = 0;
+			if (parse_number(&line, INT32_MAX, &delay)) {
+				warn(ERR_INVALID_TOKEN);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+
+			if (emit_op(prog, OP_DELAY) || emit_u32(prog, delay))
+				goto fail;
+			break;
+		}
+		case CMD_STRING: {
+			// the rest of the line, as it is
+			struct Span str = line;
+			if (str.len > 0 && str.p[str.len - 1] == '\n')
+				str.len--;
+			if (str.len == 0) {
+				warn(ERR_INVALID_TOKEN);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+
+			// encode the whole string
+			clear_report_buf(&strbuf);
+			if (encode_text(ctx, str, &strbuf, &nerrors))
+				goto fail;
+
+			// turn key presses into transitions
+			clear_report_buf(&planbuf);
+			if (plan_reports(&strbuf, &planbuf, ctx->elide_releases) == -1
+			    || emit_reports(prog, planbuf.reports, planbuf.len))
+				goto fail;
+			break;
+		}
+		case CMD_STRING_BLOCK: {
+			// every line up to END_STRING, each followed by Enter
+			struct Span block = rest;
+			bool ended = false, unmapped = false;
+
+			clear_report_buf(&strbuf);
+			while (block.len > 0) {
+				struct Span text = next_line(&block);
+				lineno++;
+				if (text.len > 1)
+					fwrite(text.p, 1, text.len, stdout);
+				if (is_block_end(text)) {
+					ended = true;
+					break;
+				}
+
+				if (text.p[text.len - 1] == '\n')
+					text.len--;
+				if (encode_text(ctx, text, &strbuf, &nerrors))
+					goto fail;
+				// without Enter the block is left out, but
+				// still read up to its end
+				if (make_hid_report(ctx, report, 1, 1, ENTER))
+					unmapped = true;
+				else if (append_report(&strbuf, report))
+					goto fail;
+				memset(report, 0x0, sizeof(report));
+			}
+			rest = block;
+
+			if (!ended) {
+				warn(ERR_UNTERMINATED_BLOCK);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+			if (unmapped) {
+				warn(ERR_NO_MAPPING);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+
+			clear_report_buf(&planbuf);
+			if (plan_reports(&strbuf, &planbuf, ctx->elide_releases) == -1
+			    || emit_reports(prog, planbuf.reports, planbuf.len))
+				goto fail;
+			break;
+		}
+		case CMD_SIMUL: {
+			// parse up to six arguments to be sent simultaneously,
+			// or more if the report format has room for them
+			uint32_t simuls[MAX_SIMUL_KEYS];
+			bool escapes_done = false, invalid = false;
+			int i = 0, num_escapes = 0;
+			int max_keys = format == REPORT_NKRO ? MAX_SIMUL_KEYS
+							     : BOOT_REPORT_KEYS;
+
+			for (; i < max_keys; i++) {
+				struct Span param = next_token(&line);
+				if (param.len == 0)
+					break;
+
+				size_t index = 0;
+				uint32_t codepoint;
+
+				// if the token is a single character, save and
+				// move on
+				if (next_codepoint(param.p, param.len, &index,
+						   &codepoint) == 0
+				    && index == param.len) {
+					simuls[i] = codepoint;
+					escapes_done = true;
+				}
+				// if it's not a single character, it should be
+				// an escape token
+				else {
+					const struct Keyword *esc = lookup_keyword(
+						param.p, param.len);
+					if (escapes_done || esc == NULL
+					    || esc->type != KW_ESCAPE) {
+						invalid = true;
+						break;
+					}
+					// add to report and move on
+					simuls[i] = esc->value;
+					num_escapes++;
+				}
+			}
+
+			// skip line if invalid token was encountered
+			if (invalid) {
+				warn(ERR_INVALID_TOKEN);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+
+			// a chord missing a key is not the chord asked for
+			if (make_hid_report_arr(ctx, report, num_escapes, i,
+						simuls)) {
+				warn(ERR_NO_MAPPING);
+				nerrors++;
+				prog->len = start;
+				continue;
+			}
+			if (emit_report(prog, report))
+				goto fail;
+			break;
+		}
+		default:
+			// END_STRING outside of a block
+			warn(ERR_INVALID_TOKEN);
+			nerrors++;
+			prog->len = start;
+			continue;
+		}
+
+		if (emit_op(prog, OP_DEFAULT_DELAY))
+			goto fail;
+		last_start = start;
+		last_len = prog->len - start;
+	}
+
+	close_script(&script);
+	free_report_buf(&strbuf);
+	free_report_buf(&planbuf);
+
+	return nerrors;
+
+fail:
+	// keep the errno realloc() or encode_string() failed with
+	error = errno;
+	close_script(&script);
+	free_report_buf(&strbuf);
+	free_report_buf(&planbuf);
+	errno = error;
+	return -1;
+}
@@ -0,0 +1,22 @@
+/*
+ * Keyword lookup for the script interpreter. The table itself is generated
+ * by mkkeywords from keywords.def.
+ */
+
+#include "keywords.h"
+#include "layouts.h"
+#include "keyword_table.h"
+#include <string.h>
+
+const struct Keyword *lookup_keyword(const char *token, size_t len)
+{
+	uint32_t h = keyword_hash(token, len, KW_SEED);
+	uint32_t slot =
+		(h / KW_BUCKETS + kw_disp[h % KW_BUCKETS]) & (KW_SLOTS - 1);
+	const struct Keyword *kw = &kw_table[slot];
+
+	if (len == 0 || kw->len != len || memcmp(kw->name, token, len))
+		return NULL;
+
+	return kw;
+}
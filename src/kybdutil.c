@@ -7,54 +7,251 @@
  */
 
 #include "kybdutil.h"
+#include "ascii.h"
+#include "unicode.h"
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-struct Layout *layout;
+void kbd_ctx_init(struct KbdCtx *ctx, const struct Layout *layout)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->layout = layout;
+	ctx->format = REPORT_BOOT;
+}
 
-void set_layout(struct Layout *lo)
+size_t report_size(int format)
 {
-	layout = lo;
+	return format == REPORT_NKRO ? NKRO_REPORT_SIZE : HID_REPORT_SIZE;
 }
 
-int make_hid_report_arr(char *report, int numescape, int argc,
-			uint32_t *codepoints)
+/**
+ * Sets the bit for a key in an NKRO report.
+ *
+ * @param[out] report NKRO report
+ * @param[in] id usage id of the key
+ * @return 0 on success, -1 if the key is outside the bitmap
+ */
+static int nkro_press(char *report, unsigned char id)
+{
+	if (id >= (NKRO_REPORT_SIZE - 2) * 8)
+		return -1;
+
+	report[2 + id / 8] |= 1 << (id % 8);
+
+	return 0;
+}
+
+int make_hid_report_arr(struct KbdCtx *ctx, char *report, int numescape,
+			int argc, uint32_t *codepoints)
 {
 	int index = 2;
 
-	if (codepoints == NULL)
+	if (codepoints == NULL || ctx->layout == NULL)
 		return -1;
 
-	for (int i = 0; i < argc && i < 6; i++) {
+	bool nkro = ctx->format == REPORT_NKRO;
+
+	for (int i = 0; i < argc && (nkro || i < BOOT_REPORT_KEYS); i++) {
 		assert(index < 8);
 		uint32_t input = codepoints[i];
 		const struct Keycode *match =
-			map_codepoint(input, layout, i < numescape);
+			map_codepoint(input, ctx->layout, i < numescape);
 		if (match == NULL)
 			return -1;
-		if (match->id != 0x00)
-			report[index++] = match->id;
+		if (match->id != 0x00) {
+			if (nkro) {
+				if (nkro_press(report, match->id))
+					return -1;
+			} else {
+				report[index++] = match->id;
+			}
+		}
 		report[0] |= match->mod;
 	}
 
 	return 0;
 }
 
-int make_hid_report(char *report, int numescape, int argc, ...)
+int make_hid_report(struct KbdCtx *ctx, char *report, int numescape, int argc,
+		    ...)
 {
 	va_list cplist;
-	uint32_t codepoints[6];
+	uint32_t codepoints[MAX_SIMUL_KEYS];
 
-	if (layout == NULL)
+	if (ctx->layout == NULL)
 		return -1;
 
+	if (argc > MAX_SIMUL_KEYS)
+		argc = MAX_SIMUL_KEYS;
+
 	va_start(cplist, argc);
-	for (int i = 0; i < argc && i < 6; i++)
+	for (int i = 0; i < argc; i++)
 		codepoints[i] = (uint32_t)va_arg(cplist, int);
 	va_end(cplist);
 
-	return make_hid_report_arr(report, numescape, argc, codepoints);
+	return make_hid_report_arr(ctx, report, numescape, argc, codepoints);
+}
+
+int init_report_buf(struct ReportBuf *buf, int format, size_t cap)
+{
+	memset(buf, 0, sizeof(*buf));
+	buf->format = format;
+	buf->report_size = report_size(format);
+
+	if (cap == 0)
+		return 0;
+
+	buf->reports = malloc(cap * buf->report_size);
+	if (buf->reports == NULL)
+		return -1;
+	buf->cap = cap;
+
+	return 0;
+}
+
+void clear_report_buf(struct ReportBuf *buf)
+{
+	buf->len = 0;
+	buf->nerrors = 0;
+}
+
+void free_report_buf(struct ReportBuf *buf)
+{
+	free(buf->reports);
+	free(buf->errors);
+	buf->reports = NULL;
+	buf->errors = NULL;
+	buf->len = buf->cap = 0;
+	buf->nerrors = buf->errcap = 0;
+}
+
+/**
+ * Makes sure a report buffer has room for a number of reports.
+ *
+ * @param[in] buf buffer to grow
+ * @param[in] cap number of reports the buffer must have room for
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int reserve_reports(struct ReportBuf *buf, size_t cap)
+{
+	if (cap <= buf->cap)
+		return 0;
+
+	if (cap < buf->cap * 2)
+		cap = buf->cap * 2;
+
+	char *grown = realloc(buf->reports, cap * buf->report_size);
+	if (grown == NULL)
+		return -1;
+
+	buf->reports = grown;
+	buf->cap = cap;
+
+	return 0;
+}
+
+int append_report(struct ReportBuf *buf, const char *report)
+{
+	if (reserve_reports(buf, buf->len + 1))
+		return -1;
+
+	memcpy(REPORT_AT(buf, buf->len++), report, buf->report_size);
+
+	return 0;
+}
+
+/**
+ * Records a character that could not be encoded.
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int add_error(struct ReportBuf *buf, size_t offset, uint32_t codepoint)
+{
+	if (buf->nerrors == buf->errcap) {
+		size_t cap = buf->errcap ? buf->errcap * 2 : 8;
+		struct EncodeError *grown =
+			realloc(buf->errors, cap * sizeof(struct EncodeError));
+		if (grown == NULL)
+			return -1;
+		buf->errors = grown;
+		buf->errcap = cap;
+	}
+
+	buf->errors[buf->nerrors].offset = offset;
+	buf->errors[buf->nerrors].codepoint = codepoint;
+	buf->nerrors++;
+
+	return 0;
+}
+
+ssize_t encode_string(const struct KbdCtx *ctx, const char *utf8, size_t len,
+		      struct ReportBuf *out)
+{
+	const struct Layout *layout = ctx->layout;
+	size_t start = out->len;
+	size_t index = 0, bad;
+
+	if (layout == NULL || utf8 == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// reject bad UTF-8 before anything is encoded
+	if (utf8_validate(utf8, len, &bad)) {
+		add_error(out, bad, 0);
+		errno = EILSEQ;
+		return -1;
+	}
+
+	// every character takes at least one byte
+	if (reserve_reports(out, out->len + len))
+		return -1;
+
+	while (index < len) {
+		size_t offset = index;
+		uint32_t codepoint;
+
+		// runs of ASCII skip decoding and go through the vector encoder
+		if (out->format == REPORT_BOOT
+		    && (unsigned char)utf8[index] < 0x80) {
+			size_t n = encode_ascii(layout->index, utf8 + index,
+						len - index,
+						REPORT_AT(out, out->len));
+			index += n;
+			out->len += n;
+			if (n > 0)
+				continue;
+		}
+
+		// cannot fail, the text has been validated
+		next_codepoint(utf8, len, &index, &codepoint);
+
+		const struct Keycode *match =
+			map_codepoint(codepoint, layout, false);
+		char *report = REPORT_AT(out, out->len);
+		memset(report, 0, out->report_size);
+
+		if (match != NULL && match->id != 0x00) {
+			if (out->format != REPORT_NKRO)
+				report[2] = match->id;
+			else if (nkro_press(report, match->id))
+				match = NULL;
+		}
+
+		if (match == NULL) {
+			if (add_error(out, offset, codepoint))
+				return -1;
+			continue;
+		}
+
+		report[0] = match->mod;
+		out->len++;
+	}
+
+	return out->len - start;
 }
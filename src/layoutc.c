@@ -0,0 +1,162 @@
+/*
+ * Layout compiler. Turns a text layout into a compiled layout image that
+ * load_layout() can map and use without parsing, or turns a set of layouts
+ * into C source for the layouts built into type.
+ */
+
+#include "layouts.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USAGE                                                                  \
+	"usage: ./layoutc <layout> <image>\n"                                  \
+	"       ./layoutc -c <source.c> <name>=<layout>..."
+
+/**
+ * Loads a text layout, printing a message on failure.
+ *
+ * @param[in] path path of the layout file
+ * @return the layout, NULL on error
+ */
+static struct Layout *compile(const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	if (in == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	struct Layout *layout = load_layout(in);
+	fclose(in);
+	if (layout == NULL)
+		fprintf(stderr, "%s: bad layout file\n", path);
+
+	return layout;
+}
+
+/**
+ * Writes the compiled image of a layout as a C array definition.
+ *
+ * @param[in] layout layout to write
+ * @param[in] symbol name of the array
+ * @param[in] out file to write to
+ * @return length of the image, 0 on error
+ */
+static size_t emit_array(const struct Layout *layout, const char *symbol,
+			 FILE *out)
+{
+	char *image;
+	size_t len;
+	FILE *mem = open_memstream(&image, &len);
+
+	if (mem == NULL || save_layout_binary(layout, mem) || fclose(mem))
+		return 0;
+
+	fprintf(out,
+		"static const unsigned char %s[%zu]\n"
+		"\t__attribute__((aligned(LAYOUT_ALIGN))) = {",
+		symbol, len);
+	for (size_t i = 0; i < len; i++)
+		fprintf(out, "%s0x%02x,", i % 12 ? " " : "\n\t",
+			(unsigned char)image[i]);
+	fprintf(out, "\n};\n\n");
+
+	free(image);
+	return len;
+}
+
+/**
+ * Writes C source defining builtin_layouts[] from name=path pairs.
+ *
+ * @param[in] path path of the source file to write
+ * @param[in] count number of pairs
+ * @param[in] specs the name=path pairs
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int emit_source(const char *path, int count, char **specs)
+{
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "/* Generated by layoutc, do not edit. */\n\n"
+		     "#include \"layouts.h\"\n\n");
+
+	for (int i = 0; i < count; i++) {
+		char *sep = strchr(specs[i], '=');
+		if (sep == NULL) {
+			fprintf(stderr, "%s\n", USAGE);
+			goto fail;
+		}
+
+		struct Layout *layout = compile(sep + 1);
+		if (layout == NULL)
+			goto fail;
+
+		char symbol[32];
+		snprintf(symbol, sizeof(symbol), "image_%d", i);
+		size_t len = emit_array(layout, symbol, out);
+		destroy_layout(layout);
+		if (len == 0) {
+			fprintf(stderr, "%s: error compiling image\n", sep + 1);
+			goto fail;
+		}
+	}
+
+	fprintf(out, "const struct BuiltinLayout builtin_layouts[] = {\n");
+	for (int i = 0; i < count; i++) {
+		char *sep = strchr(specs[i], '=');
+		fprintf(out, "\t{\"%.*s\", image_%d, sizeof(image_%d)},\n",
+			(int)(sep - specs[i]), specs[i], i, i);
+	}
+	fprintf(out, "\t{NULL, NULL, 0}\n};\n");
+
+	if (fclose(out)) {
+		perror(path);
+		unlink(path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+
+fail:
+	fclose(out);
+	unlink(path);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 3 && !strcmp(argv[1], "-c"))
+		return emit_source(argv[2], argc - 3, argv + 3);
+
+	if (argc != 3) {
+		fprintf(stderr, "%s\n", USAGE);
+		return EXIT_FAILURE;
+	}
+
+	struct Layout *layout = compile(argv[1]);
+	if (layout == NULL)
+		return EXIT_FAILURE;
+
+	FILE *out = fopen(argv[2], "wb");
+	if (out == NULL) {
+		perror(argv[2]);
+		destroy_layout(layout);
+		return EXIT_FAILURE;
+	}
+
+	if (save_layout_binary(layout, out) || fclose(out)) {
+		fprintf(stderr, "%s: error writing image\n", argv[2]);
+		unlink(argv[2]);
+		destroy_layout(layout);
+		return EXIT_FAILURE;
+	}
+
+	destroy_layout(layout);
+
+	return EXIT_SUCCESS;
+}
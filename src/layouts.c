@@ -8,76 +8,472 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(struct Layout) <= LAYOUT_HEADER_SIZE,
+	       "layout header does not fit");
+_Static_assert(sizeof(struct LayoutImageHeader) <= LAYOUT_HEADER_SIZE,
+	       "layout image header does not fit");
 
 /* clang-format off */
 
-/* Table of keycode for unprintable keys */
-static struct Keycode keys_escape[] = {
-  {.ch = ALT,       .id = 0x00, .mod=0x04}, // alt
-  {.ch = BACKSPACE, .id = 0x2A, .mod=0x00}, // backspace
-  {.ch = CONTROL,   .id = 0x00, .mod=0x01}, // ctrl
-  {.ch = DELETE,    .id = 0x4C, .mod=0x00}, // delete
-  {.ch = ESCAPE,    .id = 0x29, .mod=0x00}, // esc
-  {.ch = END,       .id = 0x4D, .mod=0x00}, // end
-  {.ch = GUI,       .id = 0x00, .mod=0x08}, // gui/win
-  {.ch = HOME,      .id = 0x4A, .mod=0x00}, // home
-  {.ch = INSERT,    .id = 0x49, .mod=0x00}, // insert
-  {.ch = DARROW,    .id = 0x51, .mod=0x00}, // down arrow
-  {.ch = UARROW,    .id = 0x52, .mod=0x00}, // up arrow
-  {.ch = LARROW,    .id = 0x50, .mod=0x00}, // left arrow
-  {.ch = RARROW,    .id = 0x4F, .mod=0x00}, // right arrow
-  {.ch = ENTER,     .id = 0x28, .mod=0x00}, // enter
-  {.ch = SPACE,     .id = 0x2C, .mod=0x00}, // space (helps with parsing)
-  {.ch = PRNTSCRN,  .id = 0x46, .mod=0x00}, // printscreen
-  {.ch = SCRLLCK,   .id = 0x47, .mod=0x00}, // scroll lock
-  {.ch = MENU,      .id = 0x76, .mod=0x00}, // menu
-  {.ch = SHIFT,     .id = 0x00, .mod=0x02}, // shift
-  {.ch = TAB,       .id = 0x2B, .mod=0x00}, // tab
-  {.ch = CAPSLOCK,  .id = 0x39, .mod=0x00}, // capslock
-  {.ch = PAUSE,     .id = 0x48, .mod=0x00}, // pause
-  {.ch = NUMLOCK,   .id = 0x53, .mod=0x00}, // numlock (keypad)
-  {.ch = PAGEDOWN,  .id = 0x4E, .mod=0x00}, // page down
-  {.ch = PAGEUP,    .id = 0x4B, .mod=0x00}, // page up
-  {.ch = CLEAR,     .id = 0x9C, .mod=0x00}, // clear
-  {.ch = F1,        .id = 0x3A, .mod=0x00}, // F1
-  {.ch = F2,        .id = 0x3B, .mod=0x00}, // F2
-  {.ch = F3,        .id = 0x3C, .mod=0x00}, // F3
-  {.ch = F4,        .id = 0x3D, .mod=0x00}, // F4
-  {.ch = F5,        .id = 0x3E, .mod=0x00}, // F5
-  {.ch = F6,        .id = 0x3F, .mod=0x00}, // F6
-  {.ch = F7,        .id = 0x40, .mod=0x00}, // F7
-  {.ch = F8,        .id = 0x41, .mod=0x00}, // F8
-  {.ch = F9,        .id = 0x42, .mod=0x00}, // F9
-  {.ch = F10,       .id = 0x43, .mod=0x00}, // F10
-  {.ch = F11,       .id = 0x44, .mod=0x00}, // F11
-  {.ch = F12,       .id = 0x45, .mod=0x00}, // F12
-  {.ch = 0x0,       .id = 0x00, .mod=0x00}
+/*
+ * Table of keycodes for unprintable keys, covering the Keyboard/Keypad
+ * usage page (0x07). Indexed directly by escape codepoint.
+ */
+static const struct Keycode keys_escape[ESCAPE_COUNT] = {
+  [ALT]             = {.ch = ALT,             .id = 0x00, .mod=0x04}, // alt
+  [BACKSPACE]       = {.ch = BACKSPACE,       .id = 0x2A, .mod=0x00}, // backspace
+  [CONTROL]         = {.ch = CONTROL,         .id = 0x00, .mod=0x01}, // ctrl
+  [DELETE]          = {.ch = DELETE,          .id = 0x4C, .mod=0x00}, // delete
+  [ESCAPE]          = {.ch = ESCAPE,          .id = 0x29, .mod=0x00}, // esc
+  [END]             = {.ch = END,             .id = 0x4D, .mod=0x00}, // end
+  [GUI]             = {.ch = GUI,             .id = 0x00, .mod=0x08}, // gui/win
+  [HOME]            = {.ch = HOME,            .id = 0x4A, .mod=0x00}, // home
+  [INSERT]          = {.ch = INSERT,          .id = 0x49, .mod=0x00}, // insert
+  [DARROW]          = {.ch = DARROW,          .id = 0x51, .mod=0x00}, // down arrow
+  [UARROW]          = {.ch = UARROW,          .id = 0x52, .mod=0x00}, // up arrow
+  [LARROW]          = {.ch = LARROW,          .id = 0x50, .mod=0x00}, // left arrow
+  [RARROW]          = {.ch = RARROW,          .id = 0x4F, .mod=0x00}, // right arrow
+  [ENTER]           = {.ch = ENTER,           .id = 0x28, .mod=0x00}, // enter
+  [SPACE]           = {.ch = SPACE,           .id = 0x2C, .mod=0x00}, // space (helps with parsing)
+  [PRNTSCRN]        = {.ch = PRNTSCRN,        .id = 0x46, .mod=0x00}, // printscreen
+  [SCRLLCK]         = {.ch = SCRLLCK,         .id = 0x47, .mod=0x00}, // scroll lock
+  [MENU]            = {.ch = MENU,            .id = 0x76, .mod=0x00}, // menu
+  [SHIFT]           = {.ch = SHIFT,           .id = 0x00, .mod=0x02}, // shift
+  [TAB]             = {.ch = TAB,             .id = 0x2B, .mod=0x00}, // tab
+  [CAPSLOCK]        = {.ch = CAPSLOCK,        .id = 0x39, .mod=0x00}, // capslock
+  [PAUSE]           = {.ch = PAUSE,           .id = 0x48, .mod=0x00}, // pause
+  [NUMLOCK]         = {.ch = NUMLOCK,         .id = 0x53, .mod=0x00}, // numlock (keypad)
+  [PAGEDOWN]        = {.ch = PAGEDOWN,        .id = 0x4E, .mod=0x00}, // page down
+  [PAGEUP]          = {.ch = PAGEUP,          .id = 0x4B, .mod=0x00}, // page up
+  [CLEAR]           = {.ch = CLEAR,           .id = 0x9C, .mod=0x00}, // clear
+  [F1]              = {.ch = F1,              .id = 0x3A, .mod=0x00}, // F1
+  [F2]              = {.ch = F2,              .id = 0x3B, .mod=0x00}, // F2
+  [F3]              = {.ch = F3,              .id = 0x3C, .mod=0x00}, // F3
+  [F4]              = {.ch = F4,              .id = 0x3D, .mod=0x00}, // F4
+  [F5]              = {.ch = F5,              .id = 0x3E, .mod=0x00}, // F5
+  [F6]              = {.ch = F6,              .id = 0x3F, .mod=0x00}, // F6
+  [F7]              = {.ch = F7,              .id = 0x40, .mod=0x00}, // F7
+  [F8]              = {.ch = F8,              .id = 0x41, .mod=0x00}, // F8
+  [F9]              = {.ch = F9,              .id = 0x42, .mod=0x00}, // F9
+  [F10]             = {.ch = F10,             .id = 0x43, .mod=0x00}, // F10
+  [F11]             = {.ch = F11,             .id = 0x44, .mod=0x00}, // F11
+  [F12]             = {.ch = F12,             .id = 0x45, .mod=0x00}, // F12
+  [NONUS_HASH]      = {.ch = NONUS_HASH,      .id = 0x32, .mod=0x00}, // non-US # and ~
+  [KP_SLASH]        = {.ch = KP_SLASH,        .id = 0x54, .mod=0x00}, // keypad /
+  [KP_ASTERISK]     = {.ch = KP_ASTERISK,     .id = 0x55, .mod=0x00}, // keypad *
+  [KP_MINUS]        = {.ch = KP_MINUS,        .id = 0x56, .mod=0x00}, // keypad -
+  [KP_PLUS]         = {.ch = KP_PLUS,         .id = 0x57, .mod=0x00}, // keypad +
+  [KP_ENTER]        = {.ch = KP_ENTER,        .id = 0x58, .mod=0x00}, // keypad enter
+  [KP_1]            = {.ch = KP_1,            .id = 0x59, .mod=0x00}, // keypad 1
+  [KP_2]            = {.ch = KP_2,            .id = 0x5A, .mod=0x00}, // keypad 2
+  [KP_3]            = {.ch = KP_3,            .id = 0x5B, .mod=0x00}, // keypad 3
+  [KP_4]            = {.ch = KP_4,            .id = 0x5C, .mod=0x00}, // keypad 4
+  [KP_5]            = {.ch = KP_5,            .id = 0x5D, .mod=0x00}, // keypad 5
+  [KP_6]            = {.ch = KP_6,            .id = 0x5E, .mod=0x00}, // keypad 6
+  [KP_7]            = {.ch = KP_7,            .id = 0x5F, .mod=0x00}, // keypad 7
+  [KP_8]            = {.ch = KP_8,            .id = 0x60, .mod=0x00}, // keypad 8
+  [KP_9]            = {.ch = KP_9,            .id = 0x61, .mod=0x00}, // keypad 9
+  [KP_0]            = {.ch = KP_0,            .id = 0x62, .mod=0x00}, // keypad 0
+  [KP_DOT]          = {.ch = KP_DOT,          .id = 0x63, .mod=0x00}, // keypad .
+  [NONUS_BSLASH]    = {.ch = NONUS_BSLASH,    .id = 0x64, .mod=0x00}, // non-US \ and |
+  [APPLICATION]     = {.ch = APPLICATION,     .id = 0x65, .mod=0x00}, // application (compose)
+  [POWER]           = {.ch = POWER,           .id = 0x66, .mod=0x00}, // power
+  [KP_EQUAL]        = {.ch = KP_EQUAL,        .id = 0x67, .mod=0x00}, // keypad =
+  [F13]             = {.ch = F13,             .id = 0x68, .mod=0x00}, // F13
+  [F14]             = {.ch = F14,             .id = 0x69, .mod=0x00}, // F14
+  [F15]             = {.ch = F15,             .id = 0x6A, .mod=0x00}, // F15
+  [F16]             = {.ch = F16,             .id = 0x6B, .mod=0x00}, // F16
+  [F17]             = {.ch = F17,             .id = 0x6C, .mod=0x00}, // F17
+  [F18]             = {.ch = F18,             .id = 0x6D, .mod=0x00}, // F18
+  [F19]             = {.ch = F19,             .id = 0x6E, .mod=0x00}, // F19
+  [F20]             = {.ch = F20,             .id = 0x6F, .mod=0x00}, // F20
+  [F21]             = {.ch = F21,             .id = 0x70, .mod=0x00}, // F21
+  [F22]             = {.ch = F22,             .id = 0x71, .mod=0x00}, // F22
+  [F23]             = {.ch = F23,             .id = 0x72, .mod=0x00}, // F23
+  [F24]             = {.ch = F24,             .id = 0x73, .mod=0x00}, // F24
+  [EXECUTE]         = {.ch = EXECUTE,         .id = 0x74, .mod=0x00}, // execute
+  [HELP]            = {.ch = HELP,            .id = 0x75, .mod=0x00}, // help
+  [SELECT]          = {.ch = SELECT,          .id = 0x77, .mod=0x00}, // select
+  [STOP]            = {.ch = STOP,            .id = 0x78, .mod=0x00}, // stop
+  [AGAIN]           = {.ch = AGAIN,           .id = 0x79, .mod=0x00}, // again
+  [UNDO]            = {.ch = UNDO,            .id = 0x7A, .mod=0x00}, // undo
+  [CUT]             = {.ch = CUT,             .id = 0x7B, .mod=0x00}, // cut
+  [COPY]            = {.ch = COPY,            .id = 0x7C, .mod=0x00}, // copy
+  [PASTE]           = {.ch = PASTE,           .id = 0x7D, .mod=0x00}, // paste
+  [FIND]            = {.ch = FIND,            .id = 0x7E, .mod=0x00}, // find
+  [MUTE]            = {.ch = MUTE,            .id = 0x7F, .mod=0x00}, // mute
+  [VOLUMEUP]        = {.ch = VOLUMEUP,        .id = 0x80, .mod=0x00}, // volume up
+  [VOLUMEDOWN]      = {.ch = VOLUMEDOWN,      .id = 0x81, .mod=0x00}, // volume down
+  [LOCKINGCAPS]     = {.ch = LOCKINGCAPS,     .id = 0x82, .mod=0x00}, // locking caps lock
+  [LOCKINGNUM]      = {.ch = LOCKINGNUM,      .id = 0x83, .mod=0x00}, // locking num lock
+  [LOCKINGSCROLL]   = {.ch = LOCKINGSCROLL,   .id = 0x84, .mod=0x00}, // locking scroll lock
+  [KP_COMMA]        = {.ch = KP_COMMA,        .id = 0x85, .mod=0x00}, // keypad ,
+  [KP_EQUALSIGN]    = {.ch = KP_EQUALSIGN,    .id = 0x86, .mod=0x00}, // keypad = (AS/400)
+  [INTL1]           = {.ch = INTL1,           .id = 0x87, .mod=0x00}, // international 1
+  [INTL2]           = {.ch = INTL2,           .id = 0x88, .mod=0x00}, // international 2
+  [INTL3]           = {.ch = INTL3,           .id = 0x89, .mod=0x00}, // international 3
+  [INTL4]           = {.ch = INTL4,           .id = 0x8A, .mod=0x00}, // international 4
+  [INTL5]           = {.ch = INTL5,           .id = 0x8B, .mod=0x00}, // international 5
+  [INTL6]           = {.ch = INTL6,           .id = 0x8C, .mod=0x00}, // international 6
+  [INTL7]           = {.ch = INTL7,           .id = 0x8D, .mod=0x00}, // international 7
+  [INTL8]           = {.ch = INTL8,           .id = 0x8E, .mod=0x00}, // international 8
+  [INTL9]           = {.ch = INTL9,           .id = 0x8F, .mod=0x00}, // international 9
+  [LANG1]           = {.ch = LANG1,           .id = 0x90, .mod=0x00}, // LANG1
+  [LANG2]           = {.ch = LANG2,           .id = 0x91, .mod=0x00}, // LANG2
+  [LANG3]           = {.ch = LANG3,           .id = 0x92, .mod=0x00}, // LANG3
+  [LANG4]           = {.ch = LANG4,           .id = 0x93, .mod=0x00}, // LANG4
+  [LANG5]           = {.ch = LANG5,           .id = 0x94, .mod=0x00}, // LANG5
+  [LANG6]           = {.ch = LANG6,           .id = 0x95, .mod=0x00}, // LANG6
+  [LANG7]           = {.ch = LANG7,           .id = 0x96, .mod=0x00}, // LANG7
+  [LANG8]           = {.ch = LANG8,           .id = 0x97, .mod=0x00}, // LANG8
+  [LANG9]           = {.ch = LANG9,           .id = 0x98, .mod=0x00}, // LANG9
+  [ALTERASE]        = {.ch = ALTERASE,        .id = 0x99, .mod=0x00}, // alternate erase
+  [SYSREQ]          = {.ch = SYSREQ,          .id = 0x9A, .mod=0x00}, // sysreq/attention
+  [CANCEL]          = {.ch = CANCEL,          .id = 0x9B, .mod=0x00}, // cancel
+  [PRIOR]           = {.ch = PRIOR,           .id = 0x9D, .mod=0x00}, // prior
+  [RETURN]          = {.ch = RETURN,          .id = 0x9E, .mod=0x00}, // return
+  [SEPARATOR]       = {.ch = SEPARATOR,       .id = 0x9F, .mod=0x00}, // separator
+  [OUT]             = {.ch = OUT,             .id = 0xA0, .mod=0x00}, // out
+  [OPER]            = {.ch = OPER,            .id = 0xA1, .mod=0x00}, // oper
+  [CLEARAGAIN]      = {.ch = CLEARAGAIN,      .id = 0xA2, .mod=0x00}, // clear/again
+  [CRSEL]           = {.ch = CRSEL,           .id = 0xA3, .mod=0x00}, // crsel/props
+  [EXSEL]           = {.ch = EXSEL,           .id = 0xA4, .mod=0x00}, // exsel
+  [KP_00]           = {.ch = KP_00,           .id = 0xB0, .mod=0x00}, // keypad 00
+  [KP_000]          = {.ch = KP_000,          .id = 0xB1, .mod=0x00}, // keypad 000
+  [THOUSANDSSEP]    = {.ch = THOUSANDSSEP,    .id = 0xB2, .mod=0x00}, // thousands separator
+  [DECIMALSEP]      = {.ch = DECIMALSEP,      .id = 0xB3, .mod=0x00}, // decimal separator
+  [CURRENCYUNIT]    = {.ch = CURRENCYUNIT,    .id = 0xB4, .mod=0x00}, // currency unit
+  [CURRENCYSUBUNIT] = {.ch = CURRENCYSUBUNIT, .id = 0xB5, .mod=0x00}, // currency sub-unit
+  [KP_LPAREN]       = {.ch = KP_LPAREN,       .id = 0xB6, .mod=0x00}, // keypad (
+  [KP_RPAREN]       = {.ch = KP_RPAREN,       .id = 0xB7, .mod=0x00}, // keypad )
+  [KP_LBRACE]       = {.ch = KP_LBRACE,       .id = 0xB8, .mod=0x00}, // keypad {
+  [KP_RBRACE]       = {.ch = KP_RBRACE,       .id = 0xB9, .mod=0x00}, // keypad }
+  [KP_TAB]          = {.ch = KP_TAB,          .id = 0xBA, .mod=0x00}, // keypad tab
+  [KP_BACKSPACE]    = {.ch = KP_BACKSPACE,    .id = 0xBB, .mod=0x00}, // keypad backspace
+  [KP_A]            = {.ch = KP_A,            .id = 0xBC, .mod=0x00}, // keypad A
+  [KP_B]            = {.ch = KP_B,            .id = 0xBD, .mod=0x00}, // keypad B
+  [KP_C]            = {.ch = KP_C,            .id = 0xBE, .mod=0x00}, // keypad C
+  [KP_D]            = {.ch = KP_D,            .id = 0xBF, .mod=0x00}, // keypad D
+  [KP_E]            = {.ch = KP_E,            .id = 0xC0, .mod=0x00}, // keypad E
+  [KP_F]            = {.ch = KP_F,            .id = 0xC1, .mod=0x00}, // keypad F
+  [KP_XOR]          = {.ch = KP_XOR,          .id = 0xC2, .mod=0x00}, // keypad xor
+  [KP_CARET]        = {.ch = KP_CARET,        .id = 0xC3, .mod=0x00}, // keypad ^
+  [KP_PERCENT]      = {.ch = KP_PERCENT,      .id = 0xC4, .mod=0x00}, // keypad %
+  [KP_LESS]         = {.ch = KP_LESS,         .id = 0xC5, .mod=0x00}, // keypad <
+  [KP_GREATER]      = {.ch = KP_GREATER,      .id = 0xC6, .mod=0x00}, // keypad >
+  [KP_AMP]          = {.ch = KP_AMP,          .id = 0xC7, .mod=0x00}, // keypad &
+  [KP_AMPAMP]       = {.ch = KP_AMPAMP,       .id = 0xC8, .mod=0x00}, // keypad &&
+  [KP_BAR]          = {.ch = KP_BAR,          .id = 0xC9, .mod=0x00}, // keypad |
+  [KP_BARBAR]       = {.ch = KP_BARBAR,       .id = 0xCA, .mod=0x00}, // keypad ||
+  [KP_COLON]        = {.ch = KP_COLON,        .id = 0xCB, .mod=0x00}, // keypad :
+  [KP_HASH]         = {.ch = KP_HASH,         .id = 0xCC, .mod=0x00}, // keypad #
+  [KP_SPACE]        = {.ch = KP_SPACE,        .id = 0xCD, .mod=0x00}, // keypad space
+  [KP_AT]           = {.ch = KP_AT,           .id = 0xCE, .mod=0x00}, // keypad @
+  [KP_BANG]         = {.ch = KP_BANG,         .id = 0xCF, .mod=0x00}, // keypad !
+  [KP_MEMSTORE]     = {.ch = KP_MEMSTORE,     .id = 0xD0, .mod=0x00}, // keypad memory store
+  [KP_MEMRECALL]    = {.ch = KP_MEMRECALL,    .id = 0xD1, .mod=0x00}, // keypad memory recall
+  [KP_MEMCLEAR]     = {.ch = KP_MEMCLEAR,     .id = 0xD2, .mod=0x00}, // keypad memory clear
+  [KP_MEMADD]       = {.ch = KP_MEMADD,       .id = 0xD3, .mod=0x00}, // keypad memory add
+  [KP_MEMSUB]       = {.ch = KP_MEMSUB,       .id = 0xD4, .mod=0x00}, // keypad memory subtract
+  [KP_MEMMUL]       = {.ch = KP_MEMMUL,       .id = 0xD5, .mod=0x00}, // keypad memory multiply
+  [KP_MEMDIV]       = {.ch = KP_MEMDIV,       .id = 0xD6, .mod=0x00}, // keypad memory divide
+  [KP_PLUSMINUS]    = {.ch = KP_PLUSMINUS,    .id = 0xD7, .mod=0x00}, // keypad +/-
+  [KP_CLEAR]        = {.ch = KP_CLEAR,        .id = 0xD8, .mod=0x00}, // keypad clear
+  [KP_CLEARENTRY]   = {.ch = KP_CLEARENTRY,   .id = 0xD9, .mod=0x00}, // keypad clear entry
+  [KP_BINARY]       = {.ch = KP_BINARY,       .id = 0xDA, .mod=0x00}, // keypad binary
+  [KP_OCTAL]        = {.ch = KP_OCTAL,        .id = 0xDB, .mod=0x00}, // keypad octal
+  [KP_DECIMAL]      = {.ch = KP_DECIMAL,      .id = 0xDC, .mod=0x00}, // keypad decimal
+  [KP_HEX]          = {.ch = KP_HEX,          .id = 0xDD, .mod=0x00}, // keypad hexadecimal
+  [LCTRL]           = {.ch = LCTRL,           .id = 0x00, .mod=0x01}, // left ctrl
+  [LSHIFT]          = {.ch = LSHIFT,          .id = 0x00, .mod=0x02}, // left shift
+  [LALT]            = {.ch = LALT,            .id = 0x00, .mod=0x04}, // left alt
+  [LGUI]            = {.ch = LGUI,            .id = 0x00, .mod=0x08}, // left gui
+  [RCTRL]           = {.ch = RCTRL,           .id = 0x00, .mod=0x10}, // right ctrl
+  [RSHIFT]          = {.ch = RSHIFT,          .id = 0x00, .mod=0x20}, // right shift
+  [RALT]            = {.ch = RALT,            .id = 0x00, .mod=0x40}, // right alt
+  [RGUI]            = {.ch = RGUI,            .id = 0x00, .mod=0x80}, // right gui
 };
 /* clang-format on */
 
+/** Rounds n up to a multiple of the cache line size */
+#define CACHELINE_ALIGN(n) (((n) + LAYOUT_ALIGN - 1) & ~(size_t)(LAYOUT_ALIGN - 1))
+
+/**
+ * Assigns a page number to every page of the index that holds at least one
+ * of the given mappings.
+ *
+ * @param[in] keys mappings to index
+ * @param[in] size number of mappings
+ * @param[out] dir page directory to fill
+ * @return number of pages assigned
+ */
+static uint32_t count_pages(const struct Keycode *keys, int size,
+			    uint16_t dir[LAYOUT_NUM_PAGES])
+{
+	uint32_t npages = 0;
+
+	memset(dir, 0, LAYOUT_NUM_PAGES * sizeof(uint16_t));
+	for (int i = 0; i < size; i++) {
+		uint32_t cp = keys[i].ch;
+		if (cp < LAYOUT_PAGE_SIZE || cp >= 0x110000)
+			continue;
+		if (!dir[cp / LAYOUT_PAGE_SIZE])
+			dir[cp / LAYOUT_PAGE_SIZE] = ++npages;
+	}
+
+	return npages;
+}
+
+/**
+ * Fills the slots and ASCII tables of a zeroed index whose directory has been
+ * set up by count_pages(). If a codepoint is mapped more than once, the first
+ * mapping wins.
+ *
+ * @param[out] index index to fill
+ * @param[in] keys mappings to index
+ * @param[in] size number of mappings
+ */
+static void fill_index(struct LayoutIndex *index, const struct Keycode *keys,
+		       int size)
+{
+	for (int i = 0; i < size; i++) {
+		uint32_t cp = keys[i].ch;
+		uint32_t *slot;
+
+		if (cp < LAYOUT_PAGE_SIZE)
+			slot = &index->latin1[cp];
+		else if (cp < 0x110000)
+			slot = &index->pages[index->dir[cp / LAYOUT_PAGE_SIZE]
+					     - 1][cp % LAYOUT_PAGE_SIZE];
+		else
+			continue;
+
+		if (*slot != 0)
+			continue;
+		*slot = i + 1;
+
+		if (cp < LAYOUT_ASCII_SIZE) {
+			index->ascii_id[cp] = keys[i].id;
+			index->ascii_mod[cp] = keys[i].mod;
+		}
+	}
+}
+
+/**
+ * Packs a set of mappings into a new layout.
+ *
+ * The layout header, the map and the lookup index are laid out back to back
+ * in a single cache-line-aligned allocation, so the whole layout is released
+ * with a single free(). Apart from the header, the block is byte for byte
+ * what save_layout_binary() writes out.
+ *
+ * @param[in] keys mappings to copy into the layout
+ * @param[in] size number of mappings
+ * @return the new layout, or NULL if it could not be allocated
+ */
+static struct Layout *pack_layout(const struct Keycode *keys, int size)
+{
+	uint16_t dir[LAYOUT_NUM_PAGES];
+	uint32_t npages = count_pages(keys, size, dir);
+
+	size_t map_off = LAYOUT_HEADER_SIZE;
+	size_t index_off =
+		map_off + CACHELINE_ALIGN(size * sizeof(struct Keycode));
+	size_t total = CACHELINE_ALIGN(index_off + sizeof(struct LayoutIndex)
+				       + npages * LAYOUT_PAGE_SIZE
+						 * sizeof(uint32_t));
+
+	char *arena = aligned_alloc(LAYOUT_ALIGN, total);
+	if (arena == NULL)
+		return NULL;
+	memset(arena, 0, total);
+
+	struct Layout *layout = (struct Layout *)arena;
+	struct Keycode *map = (struct Keycode *)(arena + map_off);
+	struct LayoutIndex *index = (struct LayoutIndex *)(arena + index_off);
+
+	// copy field by field, so that the padding of each entry stays zeroed
+	// and images built from the same layout are identical
+	for (int i = 0; i < size; i++) {
+		map[i].ch = keys[i].ch;
+		map[i].id = keys[i].id;
+		map[i].mod = keys[i].mod;
+	}
+	memcpy(index->dir, dir, sizeof(dir));
+	index->npages = npages;
+	fill_index(index, map, size);
+
+	layout->size = size;
+	layout->map = map;
+	layout->index = index;
+	layout->image = NULL;
+	layout->image_len = 0;
+
+	return layout;
+}
+
+/**
+ * Returns the length of the block holding a layout, excluding the header.
+ */
+static size_t layout_length(const struct Layout *layout)
+{
+	const char *index = (const char *)layout->index;
+
+	return CACHELINE_ALIGN(index - (const char *)layout->map
+			       + sizeof(struct LayoutIndex)
+			       + layout->index->npages * LAYOUT_PAGE_SIZE
+					 * sizeof(uint32_t));
+}
+
+struct Layout *open_layout_image(const void *image, size_t len)
+{
+	const struct LayoutImageHeader *hdr = image;
+	const char *base = image;
+
+	if (image == NULL || len < LAYOUT_HEADER_SIZE
+	    || (uintptr_t)image % LAYOUT_ALIGN != 0)
+		return NULL;
+
+	if (memcmp(hdr->magic, LAYOUT_IMAGE_MAGIC, sizeof(hdr->magic))
+	    || hdr->bom != LAYOUT_IMAGE_BOM
+	    || hdr->version != LAYOUT_IMAGE_VERSION || hdr->length != len)
+		return NULL;
+
+	// check that map and index lie within the image
+	if (hdr->map_off % LAYOUT_ALIGN || hdr->index_off % LAYOUT_ALIGN
+	    || hdr->map_off < LAYOUT_HEADER_SIZE
+	    || hdr->index_off < hdr->map_off
+	    || (hdr->index_off - hdr->map_off) / sizeof(struct Keycode)
+		       < hdr->size
+	    || hdr->npages > LAYOUT_NUM_PAGES
+	    || len < hdr->index_off + sizeof(struct LayoutIndex)
+			     + (size_t)hdr->npages * LAYOUT_PAGE_SIZE
+				       * sizeof(uint32_t))
+		return NULL;
+
+	const struct LayoutIndex *index =
+		(const struct LayoutIndex *)(base + hdr->index_off);
+	if (index->npages != hdr->npages)
+		return NULL;
+	for (int i = 0; i < LAYOUT_NUM_PAGES; i++) {
+		if (index->dir[i] > index->npages)
+			return NULL;
+	}
+
+	// the ASCII tables must agree with the mappings they are taken from
+	const struct Keycode *map =
+		(const struct Keycode *)(base + hdr->map_off);
+	for (int i = 0; i < LAYOUT_ASCII_SIZE; i++) {
+		uint32_t slot = index->latin1[i];
+		struct Keycode k = {0};
+
+		if (slot != 0 && slot <= hdr->size)
+			k = map[slot - 1];
+		if (index->ascii_id[i] != k.id || index->ascii_mod[i] != k.mod)
+			return NULL;
+	}
+
+	struct Layout *layout = malloc(sizeof(struct Layout));
+	if (layout == NULL)
+		return NULL;
+
+	layout->size = hdr->size;
+	layout->map = map;
+	layout->index = index;
+	layout->image = NULL;
+	layout->image_len = 0;
+
+	return layout;
+}
+
+struct Layout *load_layout_binary(FILE *layoutfile)
+{
+	struct stat st;
+
+	if (layoutfile == NULL || fstat(fileno(layoutfile), &st))
+		return NULL;
+
+	void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			   fileno(layoutfile), 0);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	struct Layout *layout = open_layout_image(image, st.st_size);
+	if (layout == NULL) {
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	layout->image = image;
+	layout->image_len = st.st_size;
+
+	return layout;
+}
+
+int save_layout_binary(const struct Layout *layout, FILE *outfile)
+{
+	struct LayoutImageHeader hdr;
+	char pad[LAYOUT_HEADER_SIZE] = {0};
+	size_t map_off = LAYOUT_HEADER_SIZE;
+	size_t length = layout_length(layout);
+
+	if (map_off + length > UINT32_MAX)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LAYOUT_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.bom = LAYOUT_IMAGE_BOM;
+	hdr.version = LAYOUT_IMAGE_VERSION;
+	hdr.size = layout->size;
+	hdr.npages = layout->index->npages;
+	hdr.map_off = map_off;
+	hdr.index_off = map_off
+			+ ((const char *)layout->index
+			   - (const char *)layout->map);
+	hdr.length = map_off + length;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, outfile) != 1
+	    || fwrite(pad, map_off - sizeof(hdr), 1, outfile) != 1
+	    || fwrite(layout->map, length, 1, outfile) != 1)
+		return -1;
+
+	return 0;
+}
+
 struct Layout *load_layout(FILE *layoutfile)
 {
 	if (layoutfile == NULL)
 		return NULL;
 
+	// compiled images start with a byte no text layout starts with
+	int first = getc(layoutfile);
+	if (first == LAYOUT_IMAGE_MAGIC[0])
+		return load_layout_binary(layoutfile);
+	if (first == EOF || ungetc(first, layoutfile) == EOF)
+		return NULL;
+
 	char line[50];
 
 	// start with a table size of 50
-	int table_cap = 50;
-	struct Layout *layout = malloc(sizeof(struct Layout));
-	// initialize map with cap
-	layout->size = 0;
-	layout->map = malloc(table_cap * sizeof(struct Keycode *));
+	int table_cap = 50, size = 0;
+	struct Keycode *keys = malloc(table_cap * sizeof(struct Keycode));
+	if (keys == NULL)
+		return NULL;
 
 	// check if layout file
-	fgets(line, sizeof(line), layoutfile);
-	if (!strstr(line, "-*- layout"))
+	if (fgets(line, sizeof(line), layoutfile) == NULL
+	    || !strstr(line, "-*- layout")) {
+		free(keys);
 		return NULL;
+	}
 
 	while (fgets(line, sizeof(line), layoutfile)) {
 		if (line[0] == '\n')
 			continue;
-		struct Keycode *keydef = malloc(sizeof(struct Keycode));
+		struct Keycode *keydef = &keys[size];
 		int index = 0;
 		// get the character to produce
 		keydef->ch = getCodepoint(line, &index);
@@ -88,19 +484,25 @@ struct Layout *load_layout(FILE *layoutfile)
 		sscanf(line + index, "%x %x", &id, &mod);
 		keydef->id = (char)id;
 		keydef->mod = (char)mod;
-
-		// add mapping to table
-		layout->map[layout->size++] = keydef;
+		size++;
 
 		// resize if necessary
-		if (layout->size == table_cap) {
+		if (size == table_cap) {
 			table_cap *= 2;
-			layout->map =
-				realloc(layout->map,
-					table_cap * sizeof(struct Keycode *));
+			struct Keycode *grown =
+				realloc(keys, table_cap * sizeof(struct Keycode));
+			if (grown == NULL) {
+				free(keys);
+				return NULL;
+			}
+			keys = grown;
 		}
 	}
 
+	// move the mappings into their final, contiguous home
+	struct Layout *layout = pack_layout(keys, size);
+	free(keys);
+
 	return layout;
 }
 
@@ -109,31 +511,37 @@ void destroy_layout(struct Layout *layout)
 	if (layout == NULL)
 		return;
 
-	for (int i = 0; i < layout->size; i++) {
-		free(layout->map[i]);
-	}
-	free(layout->map);
+	if (layout->image != NULL)
+		munmap(layout->image, layout->image_len);
 	free(layout);
 }
 
-const struct Keycode *map_codepoint(uint32_t codepoint, struct Layout *layout,
-				    bool escape)
+const struct Keycode *map_codepoint(uint32_t codepoint,
+				    const struct Layout *layout, bool escape)
 {
 	if (layout == NULL)
 		return NULL;
 
 	if (escape) {
-		// search known escapes
-		for (int i = 0; keys_escape[i].ch != 0x00; i++) {
-			if (codepoint == keys_escape[i].ch)
-				return &keys_escape[i];
-		}
+		// escape codepoints index the escape table
+		if (codepoint < ESCAPE_COUNT && keys_escape[codepoint].ch != 0)
+			return &keys_escape[codepoint];
 	} else {
-		// search layout
-		for (int i = 0; i < layout->size; i++) {
-			if (layout->map[i]->ch == codepoint)
-				return layout->map[i];
+		// look up layout index
+		const struct LayoutIndex *index = layout->index;
+		uint32_t slot = 0;
+
+		if (codepoint < LAYOUT_PAGE_SIZE) {
+			slot = index->latin1[codepoint];
+		} else if (codepoint < 0x110000) {
+			uint16_t page = index->dir[codepoint / LAYOUT_PAGE_SIZE];
+			if (page != 0)
+				slot = index->pages[page - 1]
+						   [codepoint % LAYOUT_PAGE_SIZE];
 		}
+
+		if (slot != 0 && slot <= (uint32_t)layout->size)
+			return &layout->map[slot - 1];
 	}
 
 	return NULL;
@@ -0,0 +1,382 @@
+/*
+ * Command line front end of the ArmoryDuckyScript interpreter.
+ */
+
+#include "type.h"
+#include "cache.h"
+#include "kybdutil.h"
+#include "layouts.h"
+#include "output.h"
+#include "program.h"
+#include "realtime.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Values getopt_long() returns for options without a short form */
+#define OPT_REALTIME 256
+#define OPT_CPU 257
+#define OPT_VIRTUAL 258
+#define OPT_CAPTURE 259
+#define OPT_COMPILE 260
+#define OPT_RUN 261
+#define OPT_CACHE 262
+
+static const struct option long_options[] = {
+	{"realtime", optional_argument, NULL, OPT_REALTIME},
+	{"cpu", required_argument, NULL, OPT_CPU},
+	{"virtual", no_argument, NULL, OPT_VIRTUAL},
+	{"capture", no_argument, NULL, OPT_CAPTURE},
+	{"compile", required_argument, NULL, OPT_COMPILE},
+	{"run", required_argument, NULL, OPT_RUN},
+	{"cache", optional_argument, NULL, OPT_CACHE},
+	{NULL, 0, NULL, 0},
+};
+
+/**
+ * Looks up a script in the cache, by the script, the layout and the
+ * encoding options.
+ *
+ * @param cache cache to open and look in
+ * @param dir cache directory, NULL for the default
+ * @param key where to store the key of the script
+ * @param ctx encoding context, without a layout yet
+ * @param infile script file, rewound afterwards
+ * @param layoutfile layout file, rewound afterwards, or NULL
+ * @param layout_name name of the built-in layout if layoutfile is NULL
+ * @param prog where to map the compiled script on a hit
+ * @return true on a hit, false on a miss
+ */
+static bool lookup_script(struct ScriptCache *cache, const char *dir,
+			  struct CacheKey *key, const struct KbdCtx *ctx,
+			  FILE *infile, FILE *layoutfile,
+			  const char *layout_name, struct Program *prog)
+{
+	if (open_cache(cache, dir, CACHE_DEFAULT_MAX_SIZE))
+		err(ERR_CANNOT_OPEN_CACHE, true, true);
+
+	init_cache_key(key, ctx);
+	if (add_cache_key_file(key, infile))
+		err(ERR_CANNOT_OPEN_INFILE, true, true);
+	if (layoutfile != NULL) {
+		if (add_cache_key_file(key, layoutfile))
+			err(ERR_CANNOT_OPEN_LAYOUTFILE, true, true);
+	} else {
+		const struct BuiltinLayout *builtin = builtin_layouts;
+		while (builtin->name != NULL
+		       && strcmp(builtin->name, layout_name) != 0)
+			builtin++;
+		if (builtin->name == NULL)
+			err(ERR_UNKNOWN_LAYOUT, false, true);
+		add_cache_key(key, builtin->image, builtin->len);
+	}
+
+	return load_cached(cache, key, prog) == 0;
+}
+
+/**
+ * Compiles the script, and exits if it cannot be compiled.
+ *
+ * @param ctx encoding context, with its layout
+ * @param infile script file
+ * @param prog where to store the compiled script
+ * @return the number of lines skipped and characters left out
+ */
+static long compile_infile(struct KbdCtx *ctx, FILE *infile,
+			   struct Program *prog)
+{
+	if (init_program(prog, ctx->format))
+		err(ERR_OUT_OF_MEMORY, false, true);
+
+	long nerrors = compile_script(ctx, infile, prog);
+	if (nerrors < 0 && errno == EILSEQ)
+		err(ERR_BAD_UNICODE, false, true);
+	if (nerrors < 0 && errno == ENOMEM)
+		err(ERR_OUT_OF_MEMORY, false, true);
+	if (nerrors < 0)
+		err(ERR_CANNOT_READ_INFILE, true, true);
+
+	return nerrors;
+}
+
+int main(int argc, char **argv)
+{
+	// args
+	FILE *infile = NULL, *layoutfile = NULL;
+	struct HidOut *out;
+	bool stats = false, uring = false, pipeline = false, realtime = false;
+	bool virtual = false, capture = false;
+	int timeout = -1, priority = RT_DEFAULT_PRIORITY, cpu = -1;
+	long rate = 0, n;
+	struct KbdCtx ctx;
+	char *outfile_path = DEFAULT_OUTPUT_FILE;
+	char *layout_name = NULL;
+	char *payload_path = NULL, *run_path = NULL;
+	bool compile = false, use_cache = false, cached = false;
+	// lines skipped and characters left out when compiling
+	long nerrors = 0;
+	char *cache_dir = NULL;
+	struct ScriptCache cache;
+	struct CacheKey key;
+	struct Program prog;
+	struct Layout *layout = NULL;
+
+	kbd_ctx_init(&ctx, NULL);
+
+	int optchar;
+	while ((optchar = getopt_long(argc, argv, "s:l:L:o:O:t:r:eNSup",
+				      long_options, NULL)) != -1) {
+		switch (optchar) {
+		case OPT_COMPILE:
+			// compile the script to a payload instead of typing
+			compile = true;
+			// fall through
+		case 's':
+			// open script file
+			infile = fopen(optarg, "rb");
+			if (infile == NULL)
+				err(ERR_CANNOT_OPEN_INFILE, true, true);
+			break;
+		case 'l':
+			// open layout file
+			layoutfile = fopen(optarg, "rb");
+			if (layoutfile == NULL)
+				err(ERR_CANNOT_OPEN_INFILE, true, true);
+			break;
+		case 'L':
+			// use built-in layout
+			layout_name = optarg;
+			break;
+		case 'o':
+			// get output file path
+			outfile_path = optarg;
+			break;
+		case 'O':
+			// get compiled payload path
+			payload_path = optarg;
+			break;
+		case 't':
+			// give up on reports the host does not read in time
+			if (parse_arg(optarg, 1, INT_MAX, &n))
+				err(ERR_USAGE, false, true);
+			timeout = n;
+			break;
+		case 'r':
+			// type at most this many characters per second
+			if (parse_arg(optarg, 1, LONG_MAX / 2, &rate))
+				err(ERR_USAGE, false, true);
+			break;
+		case 'e':
+			// only send releases where needed
+			ctx.elide_releases = true;
+			break;
+		case 'N':
+			// send n-key rollover reports
+			ctx.format = REPORT_NKRO;
+			break;
+		case 'S':
+			// report how many syscalls the output took
+			stats = true;
+			break;
+		case 'u':
+			// queue output through io_uring
+			uring = true;
+			break;
+		case 'p':
+			// write from a separate thread
+			pipeline = true;
+			break;
+		case OPT_REALTIME:
+			// run with real-time priority
+			realtime = true;
+			if (optarg != NULL) {
+				if (parse_arg(optarg, 1, 99, &n))
+					err(ERR_USAGE, false, true);
+				priority = n;
+			}
+			break;
+		case OPT_CPU:
+			// stay on one CPU
+			if (parse_arg(optarg, 0, INT_MAX, &n))
+				err(ERR_USAGE, false, true);
+			cpu = n;
+			break;
+		case OPT_VIRTUAL:
+			// trace reports on a virtual clock instead of typing
+			virtual = true;
+			break;
+		case OPT_CAPTURE:
+			// record reports in a capture file instead of typing
+			capture = true;
+			break;
+		case OPT_RUN:
+			// type a compiled payload
+			run_path = optarg;
+			break;
+		case OPT_CACHE:
+			// reuse compiled scripts
+			use_cache = true;
+			cache_dir = optarg;
+			break;
+		default:
+			err(ERR_USAGE, false, true);
+		}
+	}
+
+	// a trace or capture goes to a file, never the gadget
+	if (!compile && (virtual || capture)
+	    && strcmp(outfile_path, DEFAULT_OUTPUT_FILE) == 0)
+		err(ERR_USAGE, false, true);
+
+	if (run_path != NULL) {
+		// everything else the payload needs is in it, including the
+		// layout and the encoding options it was compiled with
+		if (infile != NULL || compile || layoutfile != NULL
+		    || layout_name != NULL || ctx.elide_releases
+		    || ctx.format != REPORT_BOOT)
+			err(ERR_USAGE, false, true);
+		int fd = open(run_path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || map_program(fd, &prog))
+			err(errno == EINVAL ? ERR_BAD_PAYLOAD
+					    : ERR_CANNOT_OPEN_PAYLOAD,
+			    errno != EINVAL, true);
+		close(fd);
+		ctx.format = prog.format;
+		ctx.elide_releases = prog.flags & PROGRAM_ELIDED;
+	} else {
+		if (infile == NULL
+		    || (layoutfile == NULL && layout_name == NULL)
+		    || compile != (payload_path != NULL))
+			err(ERR_USAGE, false, true);
+
+		if (use_cache && !compile)
+			cached = lookup_script(&cache, cache_dir, &key, &ctx,
+					       infile, layoutfile, layout_name,
+					       &prog);
+	}
+
+	if (run_path == NULL && !cached) {
+		// load layout file, or look up built-in layout
+		if (layoutfile != NULL) {
+			layout = load_layout(layoutfile);
+			if (layout == NULL)
+				err(ERR_BAD_LAYOUTFILE, false, true);
+		} else {
+			layout = load_builtin_layout(layout_name);
+			if (layout == NULL)
+				err(ERR_UNKNOWN_LAYOUT, false, true);
+		}
+
+		// set layout
+		ctx.layout = layout;
+
+		// compile before the output is opened, so that nothing is set
+		// up for a script that cannot be read
+		nerrors = compile_infile(&ctx, infile, &prog);
+	}
+
+	if (compile) {
+		// a payload is typed as is later, so it must be whole
+		if (nerrors > 0)
+			err(ERR_COMPILE_ERRORS, false, true);
+
+		int fd = open(payload_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			      0644);
+		if (fd < 0 || save_program(&prog, fd) || close(fd))
+			err(ERR_CANNOT_WRITE_PAYLOAD, true, true);
+
+		free_program(&prog);
+		destroy_layout(layout);
+		if (layoutfile != NULL)
+			fclose(layoutfile);
+		fclose(infile);
+
+		return EXIT_SUCCESS;
+	}
+
+	// keep the result for next time; a script with errors is compiled
+	// again, and warned about, every time
+	if (use_cache && !cached && nerrors == 0
+	    && store_cached(&cache, &key, &prog))
+		err(ERR_CANNOT_STORE_CACHE, true, false);
+
+	// open output file, through io_uring if asked and available
+	out = NULL;
+	if (capture) {
+		out = hid_out_open_capture(outfile_path, report_size(ctx.format),
+					   virtual);
+		if (out == NULL)
+			err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+	} else if (virtual) {
+		out = hid_out_open_trace(outfile_path, report_size(ctx.format));
+		if (out == NULL)
+			err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+	} else if (uring) {
+		out = hid_out_open_uring(outfile_path, report_size(ctx.format));
+		if (out == NULL && errno != ENOSYS && errno != EPERM)
+			err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+		if (out == NULL)
+			err(ERR_NO_URING, false, false);
+	}
+	if (out == NULL)
+		out = hid_out_open(outfile_path, report_size(ctx.format));
+	if (out == NULL)
+		err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+	if (hid_out_set_timeout(out, timeout))
+		err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+	// a character is a press and a release, unless releases are elided
+	hid_out_set_rate(out, ctx.elide_releases ? rate : 2 * rate);
+	// keep off page faults and ahead of other processes; a writer thread
+	// started below inherits priority and CPU
+	if (realtime) {
+		if (rt_lock_memory())
+			err(ERR_CANNOT_LOCK_MEMORY, true, false);
+		if (rt_set_priority(priority))
+			err(ERR_NO_REALTIME, true, false);
+	}
+	if (cpu >= 0 && rt_pin_cpu(cpu))
+		err(ERR_CANNOT_PIN_CPU, true, false);
+
+	if (pipeline) {
+		struct HidOut *pipe = hid_out_pipeline(out);
+		if (pipe == NULL)
+			err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+		out = pipe;
+	}
+
+	if (run_program(&prog, out))
+		abort_output(out);
+	if (hid_out_flush(out))
+		abort_output(out);
+
+	if (stats && out->reports > 0)
+		fprintf(stderr, "%lu reports in %lu syscalls (%.2f per report)\n",
+			out->reports, out->syscalls,
+			(double)out->syscalls / out->reports);
+	if (stats && use_cache)
+		fprintf(stderr, "cache: %llu hits, %llu misses\n",
+			(unsigned long long)cache.hits,
+			(unsigned long long)cache.misses);
+	// only outputs that sleep on the schedule themselves measure it
+	if (realtime && out->max_latency >= 0)
+		fprintf(stderr, "worst wake-up latency %.1f us\n",
+			out->max_latency / 1e3);
+	if (virtual)
+		fprintf(stderr, "typing would take %.3f s\n", out->due / 1e9);
+
+	// free resources
+	free_program(&prog);
+	destroy_layout(layout);
+	if (layoutfile != NULL)
+		fclose(layoutfile);
+	if (infile != NULL)
+		fclose(infile);
+	hid_out_close(out);
+
+	// the script was typed without its bad lines
+	return nerrors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*
+ * Keyword table generator. Builds a perfect hash table over the keywords
+ * in keywords.def using hash and displace: keywords are split into buckets
+ * by their hash, and each bucket gets a displacement that moves all of its
+ * keywords into free slots. Writes the table as a C header.
+ */
+
+#include "keywords.h"
+#include "layouts.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USAGE "usage: ./mkkeywords <header>"
+
+/** Keyword as listed in keywords.def */
+struct Entry {
+	const char *name;
+	const char *type;
+	const char *value;
+	uint32_t hash;
+};
+
+#define KEYWORD(name, type, value) {name, #type, #value, 0},
+static struct Entry entries[] = {
+#include "keywords.def"
+};
+#undef KEYWORD
+
+#define NUM_ENTRIES (sizeof(entries) / sizeof(entries[0]))
+
+/** Number of keywords in each bucket, for cmp_bucket_size() */
+static int *bucket_sizes;
+
+static int cmp_bucket_size(const void *a, const void *b)
+{
+	return bucket_sizes[*(const int *)b] - bucket_sizes[*(const int *)a];
+}
+
+/**
+ * Tries to place all keywords with the given seed.
+ *
+ * @param[in] seed hash seed
+ * @param[in] nbuckets number of buckets
+ * @param[in] nslots number of slots, a power of two
+ * @param[out] disp displacement of each bucket
+ * @param[out] slots entry index + 1 for each slot
+ * @return 0 on success, -1 if some bucket could not be placed
+ */
+static int place(uint32_t seed, int nbuckets, int nslots, uint16_t *disp,
+		 int *slots)
+{
+	int *sizes = calloc(nbuckets, sizeof(int));
+	int *order = malloc(nbuckets * sizeof(int));
+	int result = 0;
+
+	memset(slots, 0, nslots * sizeof(int));
+	for (size_t i = 0; i < NUM_ENTRIES; i++) {
+		entries[i].hash = keyword_hash(
+			entries[i].name, strlen(entries[i].name), seed);
+		sizes[entries[i].hash % nbuckets]++;
+	}
+
+	// place the largest buckets first, while there is most room
+	for (int b = 0; b < nbuckets; b++)
+		order[b] = b;
+	bucket_sizes = sizes;
+	qsort(order, nbuckets, sizeof(int), cmp_bucket_size);
+
+	for (int o = 0; o < nbuckets && sizes[order[o]] > 0; o++) {
+		int b = order[o], d;
+
+		for (d = 0; d < nslots; d++) {
+			bool fits = true;
+
+			for (size_t i = 0; i < NUM_ENTRIES && fits; i++) {
+				if (entries[i].hash % nbuckets != (uint32_t)b)
+					continue;
+				int s = (entries[i].hash / nbuckets + d)
+					& (nslots - 1);
+				if (slots[s])
+					fits = false;
+				else
+					slots[s] = i + 1;
+			}
+
+			if (fits)
+				break;
+
+			// undo partial placement
+			for (int s = 0; s < nslots; s++) {
+				if (slots[s]
+				    && entries[slots[s] - 1].hash % nbuckets
+					       == (uint32_t)b)
+					slots[s] = 0;
+			}
+		}
+
+		if (d == nslots) {
+			result = -1;
+			break;
+		}
+		disp[b] = d;
+	}
+
+	free(sizes);
+	free(order);
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "%s\n", USAGE);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < NUM_ENTRIES; i++) {
+		for (size_t j = 0; j < i; j++) {
+			if (!strcmp(entries[i].name, entries[j].name)) {
+				fprintf(stderr, "duplicate keyword %s\n",
+					entries[i].name);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	// keep the table at most 80% full, with about two keywords per bucket
+	int nslots = 1, nbuckets = NUM_ENTRIES / 2 + 1;
+	while (nslots * 4 < (int)NUM_ENTRIES * 5)
+		nslots *= 2;
+
+	uint16_t *disp = calloc(nbuckets, sizeof(uint16_t));
+	int *slots = malloc(nslots * sizeof(int));
+	uint32_t seed;
+
+	for (seed = 0; seed < 100000; seed++) {
+		memset(disp, 0, nbuckets * sizeof(uint16_t));
+		if (place(seed, nbuckets, nslots, disp, slots) == 0)
+			break;
+	}
+	if (seed == 100000) {
+		fprintf(stderr, "no perfect hash found\n");
+		return EXIT_FAILURE;
+	}
+
+	FILE *out = fopen(argv[1], "w");
+	if (out == NULL) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "/* Generated by mkkeywords from keywords.def, do not "
+		     "edit. */\n\n");
+	fprintf(out, "#define KW_SEED %uu\n", seed);
+	fprintf(out, "#define KW_BUCKETS %d\n", nbuckets);
+	fprintf(out, "#define KW_SLOTS %d\n\n", nslots);
+
+	fprintf(out, "static const uint16_t kw_disp[KW_BUCKETS] = {");
+	for (int b = 0; b < nbuckets; b++)
+		fprintf(out, "%s%u,", b % 12 ? " " : "\n\t", disp[b]);
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static const struct Keyword kw_table[KW_SLOTS] = {\n");
+	for (int s = 0; s < nslots; s++) {
+		if (!slots[s])
+			continue;
+		struct Entry *e = &entries[slots[s] - 1];
+		fprintf(out, "\t[%d] = {\"%s\", %zu, %s, %s},\n", s, e->name,
+			strlen(e->name), e->type, e->value);
+	}
+	fprintf(out, "};\n");
+
+	free(disp);
+	free(slots);
+
+	if (fclose(out)) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,539 @@
+/*
+ * Report output on raw file descriptors.
+ */
+
+#include "output.h"
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SEC 1000000000LL
+#define NS_PER_MS 1000000LL
+
+/** Lateness in ns that later pauses are shortened to make up for */
+#define PACE_SLACK (HID_OUT_PACE_SLACK * NS_PER_MS)
+
+int set_blocking(int fd, bool blocking)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	if (!(flags & O_NONBLOCK) == blocking)
+		return 0;
+
+	flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+	return fcntl(fd, F_SETFL, flags);
+}
+
+/**
+ * Waits until the device has room for a report, or the deadline passes.
+ */
+static int wait_writable(struct HidOut *out)
+{
+	struct pollfd pfd = {.fd = out->fd, .events = POLLOUT};
+	int ready;
+
+	do {
+		ready = poll(&pfd, 1, out->timeout);
+		out->syscalls++;
+	} while (ready < 0 && errno == EINTR);
+
+	if (ready == 0)
+		errno = ETIMEDOUT;
+	if (ready <= 0)
+		return -1;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Sleeps until a point in time, unless it has passed already, and keeps
+ * track of how late it woke up.
+ */
+static void sleep_until(struct HidOut *out, long long t)
+{
+	struct timespec ts = {.tv_sec = t / NS_PER_SEC,
+			      .tv_nsec = t % NS_PER_SEC};
+
+	if (t <= now_ns())
+		return;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	       == EINTR)
+		;
+
+	long long late = now_ns() - t;
+	if (late > out->max_latency)
+		out->max_latency = late;
+}
+
+/**
+ * Books the next ns nanoseconds of the schedule and returns when they
+ * start. A schedule that has fallen behind by no more than
+ * HID_OUT_PACE_SLACK carries on, so that oversleeping and the time spent
+ * writing are taken off the next pause; one that has fallen further
+ * behind, because the host stalled or nothing was paced for a while,
+ * starts over from now.
+ */
+static long long pace(struct HidOut *out, long long ns)
+{
+	long long now = now_ns();
+	long long start;
+
+	if (out->due < now - PACE_SLACK)
+		out->due = now;
+
+	start = out->due;
+	out->due += ns;
+	return start;
+}
+
+/**
+ * Writes reports with writev(), HID_OUT_BATCH at a time, one iovec per
+ * report. After a short write, the first iovec of the next batch holds the
+ * rest of the report the kernel stopped in. When the device is full, waits
+ * for it in poll().
+ *
+ * A short write on a non-blocking descriptor, which has one once a deadline
+ * is set, means the device is full, so it is waited for right away rather
+ * than found out by a writev() that fails with EAGAIN.
+ */
+static int write_now(struct HidOut *out, const char *reports, size_t n)
+{
+	size_t size = out->report_size;
+	size_t total = n * size;
+	size_t done = 0;
+
+	while (done < total) {
+		struct iovec iov[HID_OUT_BATCH];
+		size_t off = done;
+		int cnt = 0;
+
+		for (; cnt < HID_OUT_BATCH && off < total; cnt++) {
+			size_t end = (off / size + 1) * size;
+			iov[cnt].iov_base = (char *)reports + off;
+			iov[cnt].iov_len = end - off;
+			off = end;
+		}
+
+		ssize_t written = writev(out->fd, iov, cnt);
+		out->syscalls++;
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK)
+			    && wait_writable(out) == 0)
+				continue;
+			return -1;
+		}
+		if (written == 0) {
+			errno = EIO;
+			return -1;
+		}
+		done += written;
+		if (done < total && out->timeout >= 0 && wait_writable(out))
+			return -1;
+	}
+
+	out->reports += n;
+	return 0;
+}
+
+/**
+ * Writes reports as fast as the device takes them, or with a rate set, one
+ * at a time, each when it is due.
+ */
+static int fd_write(struct HidOut *out, const char *reports, size_t n)
+{
+	if (out->interval == 0)
+		return write_now(out, reports, n);
+
+	for (size_t i = 0; i < n; i++) {
+		sleep_until(out, pace(out, out->interval));
+		if (write_now(out, reports + i * out->report_size, 1))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Sleeps until the end of the pause on the schedule, rather than for the
+ * length of it, so that pauses do not add up to more than they should.
+ */
+static int fd_delay(struct HidOut *out, long long ns)
+{
+	pace(out, ns);
+	sleep_until(out, out->due);
+
+	return 0;
+}
+
+static const struct HidOutOps fd_ops = {
+	.write = fd_write,
+	.delay = fd_delay,
+	.flush = NULL,
+	.abort = NULL,
+	.close = NULL,
+};
+
+struct HidOut *hid_out_fdopen(int fd, size_t report_size)
+{
+	struct HidOut *out = calloc(1, sizeof(struct HidOut));
+
+	if (out == NULL)
+		return NULL;
+
+	out->ops = &fd_ops;
+	out->fd = fd;
+	out->report_size = report_size;
+	out->timeout = -1;
+
+	return out;
+}
+
+/*
+ * Capture output: instead of being sent, reports are recorded in a capture
+ * file along with the time they would have been sent at and the script line
+ * they came from.
+ */
+
+struct CaptureOut {
+	// must come first, see hid_out_close()
+	struct HidOut out;
+	// CAPTURE_* flags of the file
+	uint32_t flags;
+};
+
+/**
+ * Writes a whole buffer, waiting in poll() when the file is full.
+ */
+static int write_all(struct HidOut *out, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t written = write(out->fd, buf, len);
+		out->syscalls++;
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK)
+			    && wait_writable(out) == 0)
+				continue;
+			return -1;
+		}
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the time of the next report: the virtual clock, or once the
+ * report is due on the schedule, the real one.
+ */
+static long long capture_time(struct CaptureOut *c)
+{
+	struct HidOut *out = &c->out;
+	long long t;
+
+	if (c->flags & CAPTURE_VIRTUAL) {
+		t = out->due;
+		out->due += out->interval;
+		return t;
+	}
+
+	if (out->interval > 0)
+		sleep_until(out, pace(out, out->interval));
+	return now_ns();
+}
+
+/**
+ * Records reports HID_OUT_BATCH at a time, with one write() per batch.
+ */
+static int capture_write(struct HidOut *out, const char *reports, size_t n)
+{
+	struct CaptureOut *c = (struct CaptureOut *)out;
+	size_t size = capture_record_size(out->report_size);
+	char buf[HID_OUT_BATCH * CAPTURE_MAX_RECORD] __attribute__((aligned(8)));
+
+	for (size_t done = 0; done < n;) {
+		size_t cnt = 0;
+
+		for (; cnt < HID_OUT_BATCH && done + cnt < n; cnt++) {
+			struct CaptureRecord *rec =
+				(struct CaptureRecord *)(buf + cnt * size);
+
+			memset(rec, 0, size);
+			rec->time = capture_time(c);
+			rec->line = out->line;
+			rec->cmd = out->cmd;
+			memcpy(rec->report,
+			       reports + (done + cnt) * out->report_size,
+			       out->report_size);
+		}
+
+		if (write_all(out, buf, cnt * size))
+			return -1;
+		done += cnt;
+	}
+
+	out->reports += n;
+	return 0;
+}
+
+static int capture_delay(struct HidOut *out, long long ns)
+{
+	struct CaptureOut *c = (struct CaptureOut *)out;
+
+	if (c->flags & CAPTURE_VIRTUAL) {
+		out->due += ns;
+		return 0;
+	}
+
+	return fd_delay(out, ns);
+}
+
+static const struct HidOutOps capture_ops = {
+	.write = capture_write,
+	.delay = capture_delay,
+	.flush = NULL,
+	.abort = NULL,
+	.close = NULL,
+};
+
+/**
+ * Checks that a capture file being appended to records the same kind of
+ * reports, on the same kind of clock.
+ */
+static int check_appendable(int fd, const struct CaptureHeader *header,
+			    off_t size)
+{
+	struct CaptureHeader old;
+
+	if (pread(fd, &old, sizeof(old), 0) != sizeof(old))
+		return -1;
+
+	if (check_capture_header(&old)
+	    || old.report_size != header->report_size
+	    || old.flags != header->flags
+	    || (size - sizeof(old)) % old.record_size != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct HidOut *hid_out_capture_fdopen(int fd, size_t report_size,
+				      bool virtual)
+{
+	struct CaptureHeader header;
+	struct CaptureOut *c;
+	struct stat st;
+
+	if (report_size > CAPTURE_MAX_REPORT) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (fstat(fd, &st))
+		return NULL;
+
+	c = calloc(1, sizeof(struct CaptureOut));
+	if (c == NULL)
+		return NULL;
+
+	c->flags = virtual ? CAPTURE_VIRTUAL : 0;
+	c->out.ops = &capture_ops;
+	c->out.fd = fd;
+	c->out.report_size = report_size;
+	c->out.timeout = -1;
+	// only the real clock is slept on
+	c->out.max_latency = virtual ? -1 : 0;
+
+	// a new file starts with the header, an old one must match it
+	init_capture_header(&header, report_size, c->flags);
+	if (S_ISREG(st.st_mode) && st.st_size > 0
+		    ? check_appendable(fd, &header, st.st_size)
+		    : write_all(&c->out, (const char *)&header, sizeof(header))) {
+		int saved = errno;
+		free(c);
+		errno = saved;
+		return NULL;
+	}
+
+	return &c->out;
+}
+
+/**
+ * Opens a file for output, with O_WRONLY or O_RDWR as mode. The descriptor
+ * is blocking until a deadline is set.
+ */
+static int open_file(const char *path, int mode)
+{
+	return open(path, mode | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+}
+
+/**
+ * Makes a new output the owner of the descriptor it was opened on, or
+ * closes the descriptor if the output could not be created.
+ */
+static struct HidOut *adopt_fd(struct HidOut *out, int fd)
+{
+	if (out == NULL) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return NULL;
+	}
+	out->owns_fd = true;
+
+	return out;
+}
+
+/**
+ * Opens a file for output and hands it to a backend, which takes ownership
+ * of the descriptor.
+ */
+static struct HidOut *open_output(const char *path, size_t report_size,
+				  struct HidOut *(*fdopen)(int, size_t))
+{
+	int fd = open_file(path, O_WRONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	return adopt_fd(fdopen(fd, report_size), fd);
+}
+
+struct HidOut *hid_out_open(const char *path, size_t report_size)
+{
+	return open_output(path, report_size, hid_out_fdopen);
+}
+
+struct HidOut *hid_out_open_uring(const char *path, size_t report_size)
+{
+	return open_output(path, report_size, hid_out_uring_fdopen);
+}
+
+struct HidOut *hid_out_open_trace(const char *path, size_t report_size)
+{
+	return open_output(path, report_size, hid_out_trace_fdopen);
+}
+
+struct HidOut *hid_out_open_capture(const char *path, size_t report_size,
+				    bool virtual)
+{
+	// appending checks the header that is already there
+	int fd = open_file(path, O_RDWR);
+
+	if (fd < 0)
+		return NULL;
+
+	return adopt_fd(hid_out_capture_fdopen(fd, report_size, virtual), fd);
+}
+
+int hid_out_write(struct HidOut *out, const char *reports, size_t n)
+{
+	return out->ops->write(out, reports, n);
+}
+
+int hid_out_set_timeout(struct HidOut *out, int ms)
+{
+	// only the synchronous backend waits in poll() itself, and only needs
+	// to once there is a deadline to keep
+	if (out->ops == &fd_ops && ms >= 0 && set_blocking(out->fd, false))
+		return -1;
+
+	out->timeout = ms;
+	return 0;
+}
+
+void hid_out_set_rate(struct HidOut *out, long per_sec)
+{
+	out->interval = per_sec > 0 ? NS_PER_SEC / per_sec : 0;
+}
+
+/**
+ * Sends the all-keys-up report right away, with a deadline.
+ */
+static int release_keys(struct HidOut *out)
+{
+	char up[HID_OUT_MAX_REPORT] = {0};
+
+	if (hid_out_set_timeout(out, out->timeout < 0 ? HID_OUT_ABORT_TIMEOUT
+						      : out->timeout))
+		return -1;
+
+	out->interval = 0;
+	return hid_out_write(out, up, 1);
+}
+
+int hid_out_abort_fd(struct HidOut *out)
+{
+	out->ops = &fd_ops;
+	return release_keys(out);
+}
+
+int hid_out_abort(struct HidOut *out)
+{
+	if (out->ops->abort != NULL)
+		return out->ops->abort(out);
+
+	return release_keys(out);
+}
+
+int hid_out_delay(struct HidOut *out, long ms)
+{
+	return hid_out_delay_ns(out, ms * NS_PER_MS);
+}
+
+int hid_out_delay_ns(struct HidOut *out, long long ns)
+{
+	if (ns <= 0)
+		return 0;
+
+	return out->ops->delay(out, ns);
+}
+
+int hid_out_flush(struct HidOut *out)
+{
+	if (out->ops->flush == NULL)
+		return 0;
+
+	return out->ops->flush(out);
+}
+
+void hid_out_close(struct HidOut *out)
+{
+	if (out == NULL)
+		return;
+
+	hid_out_flush(out);
+	if (out->ops->close != NULL)
+		out->ops->close(out);
+	if (out->owns_fd)
+		close(out->fd);
+	free(out);
+}
@@ -0,0 +1,368 @@
+/*
+ * Pipelined report output.
+ *
+ * The interpreter's thread queues reports and pauses in a single-producer
+ * single-consumer ring, and a writer thread takes them off the ring and
+ * hands them to the wrapped output. Reports for the next lines are thus
+ * encoded while the writer sleeps through a DELAY or waits for the host,
+ * and the writer's loop does nothing but copy out of the ring and write.
+ *
+ * The ring has no locks: each side only advances its own index. A side
+ * that finds the ring empty or full sleeps on a futex, and the other side
+ * only makes the wake-up syscall if it is asleep, so a steady stream of
+ * reports costs no syscalls beyond the writes themselves.
+ */
+
+#include "output.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/** Entries in the ring */
+#define PIPE_ENTRIES 64
+/** Keeps the two sides' fields on separate cache lines */
+#define PIPE_ALIGN 64
+
+#define PIPE_WRITE 0
+#define PIPE_DELAY 1
+#define PIPE_FLUSH 2
+
+struct PipeEntry {
+	// PIPE_WRITE, PIPE_DELAY or PIPE_FLUSH
+	int kind;
+	// number of reports, or nanoseconds to pause
+	long long n;
+	// script line and command the entry came from
+	unsigned long line;
+	unsigned cmd;
+	char reports[HID_OUT_BATCH * HID_OUT_MAX_REPORT];
+};
+
+/**
+ * Something one side waits for and the other side signals.
+ */
+struct PipeEvent {
+	// futex word, bumped on every signal
+	unsigned seq;
+	// whether the waiting side is asleep, or about to be
+	unsigned sleeping;
+};
+
+struct PipeOut {
+	// must come first, see hid_out_close()
+	struct HidOut out;
+	// output written to by the writer thread
+	struct HidOut *inner;
+	pthread_t writer;
+
+	// written by the interpreter: entries queued so far
+	__attribute__((aligned(PIPE_ALIGN))) unsigned tail;
+	// signaled when an entry is queued or the writer should stop
+	struct PipeEvent queued;
+	// tells the writer to drop what is queued and exit
+	bool stop;
+
+	// written by the writer: entries done so far
+	__attribute__((aligned(PIPE_ALIGN))) unsigned head;
+	// signaled when an entry is done
+	struct PipeEvent done;
+	// errno of the first failure, 0 if none
+	int error;
+
+	struct PipeEntry ring[PIPE_ENTRIES];
+};
+
+static void signal_event(struct PipeEvent *ev)
+{
+	__atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ev->sleeping, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+			0);
+}
+
+/**
+ * Sleeps on an event until ready() holds.
+ *
+ * The sleeping flag is raised before the futex word is read, and the
+ * signaling side bumps the word before it looks at the flag. Either the
+ * signal sees the flag and wakes us, or the word has moved on and the futex
+ * does not sleep at all.
+ */
+static void wait_event(struct PipeOut *p, struct PipeEvent *ev,
+		       bool (*ready)(struct PipeOut *p))
+{
+	while (!ready(p)) {
+		__atomic_store_n(&ev->sleeping, 1, __ATOMIC_SEQ_CST);
+		unsigned seq = __atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST);
+		if (!ready(p))
+			syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq,
+				NULL, NULL, 0);
+		__atomic_store_n(&ev->sleeping, 0, __ATOMIC_RELAXED);
+	}
+}
+
+static bool has_work(struct PipeOut *p)
+{
+	return __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) != p->head
+	       || __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+}
+
+static bool has_room(struct PipeOut *p)
+{
+	return p->tail - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE)
+	       < PIPE_ENTRIES;
+}
+
+static bool is_idle(struct PipeOut *p)
+{
+	return __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->tail;
+}
+
+/**
+ * Runs one entry against the wrapped output.
+ */
+static int run_entry(struct HidOut *out, const struct PipeEntry *e)
+{
+	switch (e->kind) {
+	case PIPE_WRITE:
+		return hid_out_write(out, e->reports, e->n);
+	case PIPE_DELAY:
+		return hid_out_delay_ns(out, e->n);
+	case PIPE_FLUSH:
+		return hid_out_flush(out);
+	}
+
+	return 0;
+}
+
+static void *writer_main(void *arg)
+{
+	struct PipeOut *p = arg;
+
+	for (;;) {
+		wait_event(p, &p->queued, has_work);
+		if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		// after a failure, entries are only taken off the ring
+		struct PipeEntry *e = &p->ring[p->head % PIPE_ENTRIES];
+		p->inner->line = e->line;
+		p->inner->cmd = e->cmd;
+		if (p->error == 0 && run_entry(p->inner, e))
+			__atomic_store_n(&p->error, errno, __ATOMIC_RELEASE);
+
+		__atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+		signal_event(&p->done);
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the error the writer ran into, if any, with errno set.
+ */
+static int check_error(struct PipeOut *p)
+{
+	int error = __atomic_load_n(&p->error, __ATOMIC_ACQUIRE);
+
+	if (error == 0)
+		return 0;
+
+	errno = error;
+	return -1;
+}
+
+/**
+ * Returns the next free entry, once there is one.
+ */
+static struct PipeEntry *claim(struct PipeOut *p)
+{
+	if (check_error(p))
+		return NULL;
+
+	wait_event(p, &p->done, has_room);
+	return &p->ring[p->tail % PIPE_ENTRIES];
+}
+
+/**
+ * Hands the entry returned by claim() to the writer.
+ */
+static void publish(struct PipeOut *p)
+{
+	struct PipeEntry *e = &p->ring[p->tail % PIPE_ENTRIES];
+
+	e->line = p->out.line;
+	e->cmd = p->out.cmd;
+	__atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+	signal_event(&p->queued);
+}
+
+static int pipe_write(struct HidOut *out, const char *reports, size_t n)
+{
+	struct PipeOut *p = (struct PipeOut *)out;
+
+	while (n > 0) {
+		size_t cnt = n < HID_OUT_BATCH ? n : HID_OUT_BATCH;
+		struct PipeEntry *e = claim(p);
+
+		if (e == NULL)
+			return -1;
+
+		e->kind = PIPE_WRITE;
+		e->n = cnt;
+		memcpy(e->reports, reports, cnt * out->report_size);
+		publish(p);
+
+		reports += cnt * out->report_size;
+		out->reports += cnt;
+		n -= cnt;
+	}
+
+	return 0;
+}
+
+static int pipe_delay(struct HidOut *out, long long ns)
+{
+	struct PipeOut *p = (struct PipeOut *)out;
+	struct PipeEntry *e = claim(p);
+
+	if (e == NULL)
+		return -1;
+
+	e->kind = PIPE_DELAY;
+	e->n = ns;
+	publish(p);
+
+	return 0;
+}
+
+static int pipe_flush(struct HidOut *out)
+{
+	struct PipeOut *p = (struct PipeOut *)out;
+	struct PipeEntry *e = claim(p);
+
+	if (e == NULL)
+		return -1;
+
+	e->kind = PIPE_FLUSH;
+	publish(p);
+	wait_event(p, &p->done, is_idle);
+
+	// the writer is idle, so its output can be looked at
+	out->syscalls = p->inner->syscalls;
+	out->max_latency = p->inner->max_latency;
+	out->due = p->inner->due;
+	return check_error(p);
+}
+
+static void stop_writer(struct PipeOut *p)
+{
+	__atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+	signal_event(&p->queued);
+	pthread_join(p->writer, NULL);
+}
+
+static void pipe_close(struct HidOut *out)
+{
+	struct PipeOut *p = (struct PipeOut *)out;
+
+	stop_writer(p);
+	hid_out_close(p->inner);
+}
+
+/*
+ * Once the writer has stopped, calls go straight to the wrapped output.
+ */
+
+static int direct_write(struct HidOut *out, const char *reports, size_t n)
+{
+	struct PipeOut *p = (struct PipeOut *)out;
+
+	p->inner->line = out->line;
+	p->inner->cmd = out->cmd;
+	out->reports += n;
+	return hid_out_write(p->inner, reports, n);
+}
+
+static int direct_delay(struct HidOut *out, long long ns)
+{
+	return hid_out_delay_ns(((struct PipeOut *)out)->inner, ns);
+}
+
+static int direct_flush(struct HidOut *out)
+{
+	return hid_out_flush(((struct PipeOut *)out)->inner);
+}
+
+static int direct_abort(struct HidOut *out)
+{
+	return hid_out_abort(((struct PipeOut *)out)->inner);
+}
+
+static void direct_close(struct HidOut *out)
+{
+	hid_out_close(((struct PipeOut *)out)->inner);
+}
+
+static const struct HidOutOps direct_ops = {
+	.write = direct_write,
+	.delay = direct_delay,
+	.flush = direct_flush,
+	.abort = direct_abort,
+	.close = direct_close,
+};
+
+/**
+ * Stops the writer, dropping whatever is still queued, and aborts the
+ * wrapped output, which sends the all-keys-up report.
+ */
+static int pipe_abort(struct HidOut *out)
+{
+	struct PipeOut *p = (struct PipeOut *)out;
+
+	stop_writer(p);
+	out->syscalls = p->inner->syscalls;
+	out->ops = &direct_ops;
+
+	return hid_out_abort(p->inner);
+}
+
+static const struct HidOutOps pipe_ops = {
+	.write = pipe_write,
+	.delay = pipe_delay,
+	.flush = pipe_flush,
+	.abort = pipe_abort,
+	.close = pipe_close,
+};
+
+struct HidOut *hid_out_pipeline(struct HidOut *inner)
+{
+	struct PipeOut *p = aligned_alloc(PIPE_ALIGN, sizeof(struct PipeOut));
+
+	if (p == NULL)
+		return NULL;
+	memset(p, 0, sizeof(struct PipeOut));
+
+	p->out.ops = &pipe_ops;
+	p->out.fd = inner->fd;
+	p->out.owns_fd = inner->owns_fd;
+	p->out.report_size = inner->report_size;
+	p->out.timeout = inner->timeout;
+	p->out.interval = inner->interval;
+	p->out.max_latency = inner->max_latency;
+	p->inner = inner;
+
+	int ret = pthread_create(&p->writer, NULL, writer_main, p);
+	if (ret != 0) {
+		free(p);
+		errno = ret;
+		return NULL;
+	}
+	inner->owns_fd = false;
+
+	return &p->out;
+}
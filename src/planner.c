@@ -0,0 +1,129 @@
+/*
+ * Report transition planner. Turns key presses into the key state
+ * transitions that are sent to the host.
+ */
+
+#include "planner.h"
+#include <string.h>
+
+/** Index of the first key slot or bitmap byte in a report */
+#define FIRST_KEY 2
+
+/**
+ * Checks whether a report holds a key in any of its key slots.
+ */
+static bool has_key(const char *report, char id)
+{
+	for (int i = FIRST_KEY; i < HID_REPORT_SIZE; i++) {
+		if (report[i] == id)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Checks whether a report presses any keys besides modifiers.
+ */
+static bool has_keys(const char *report, size_t size)
+{
+	for (size_t i = FIRST_KEY; i < size; i++) {
+		if (report[i] != 0x00)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Checks whether two reports press any of the same keys.
+ */
+static bool share_key(const char *a, const char *b, int format)
+{
+	if (format == REPORT_NKRO) {
+		for (int i = FIRST_KEY; i < NKRO_REPORT_SIZE; i++) {
+			if (a[i] & b[i])
+				return true;
+		}
+	} else {
+		for (int i = FIRST_KEY; i < HID_REPORT_SIZE; i++) {
+			if (b[i] != 0x00 && has_key(a, b[i]))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Decides what must be sent between the current key state and the next
+ * press.
+ *
+ * @param[in] cur current key state
+ * @param[in] next next press
+ * @param[in] format format of the reports
+ * @param[out] release release report to send first, if any
+ * @return whether a release must be sent first
+ */
+static bool plan_release(const char *cur, const char *next, int format,
+			 char *release)
+{
+	size_t size = report_size(format);
+
+	memset(release, 0x00, size);
+
+	// nothing is down
+	if (cur[0] == 0x00 && !has_keys(cur, size))
+		return false;
+
+	// modifier change, or nothing new would be pressed
+	if (cur[0] != next[0] || !has_keys(next, size))
+		return true;
+
+	// repeated key: release the keys, keep holding the modifiers
+	if (share_key(cur, next, format)) {
+		release[0] = cur[0];
+		return true;
+	}
+
+	return false;
+}
+
+ssize_t plan_reports(const struct ReportBuf *in, struct ReportBuf *out,
+		     bool elide)
+{
+	char cur[MAX_REPORT_SIZE] = {0};
+	char release[MAX_REPORT_SIZE];
+	size_t size = in->report_size;
+	size_t start = out->len;
+
+	if (out->format != in->format)
+		return -1;
+
+	for (size_t i = 0; i < in->len; i++) {
+		const char *next = REPORT_AT(in, i);
+
+		if (elide) {
+			if (plan_release(cur, next, in->format, release)
+			    && append_report(out, release))
+				return -1;
+		} else if (i > 0) {
+			memset(release, 0x00, size);
+			if (append_report(out, release))
+				return -1;
+		}
+
+		if (append_report(out, next))
+			return -1;
+		memcpy(cur, next, size);
+	}
+
+	// leave all keys up
+	if (in->len > 0) {
+		memset(release, 0x00, size);
+		if (append_report(out, release))
+			return -1;
+	}
+
+	return out->len - start;
+}
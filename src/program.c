@@ -0,0 +1,118 @@
+/*
+ * Compiled programs and the payload files they are saved in.
+ */
+
+#include "program.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Room for the code of a script of a few lines */
+#define PROGRAM_INITIAL_CAP 4096
+
+int init_program(struct Program *prog, int format)
+{
+	memset(prog, 0, sizeof(struct Program));
+	prog->format = format;
+	prog->report_size = report_size(format);
+	prog->cap = PROGRAM_INITIAL_CAP;
+	prog->code = malloc(prog->cap);
+
+	return prog->code == NULL ? -1 : 0;
+}
+
+void free_program(struct Program *prog)
+{
+	if (prog->image != NULL)
+		munmap(prog->image, prog->image_len);
+	else
+		free(prog->code);
+	prog->code = NULL;
+	prog->image = NULL;
+	prog->len = prog->cap = 0;
+}
+
+/**
+ * Writes a whole buffer, however many writes it takes.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int save_program(const struct Program *prog, int fd)
+{
+	struct PayloadHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PAYLOAD_MAGIC, sizeof(header.magic));
+	header.version = PAYLOAD_VERSION;
+	header.format = prog->format;
+	header.flags = prog->flags;
+	header.code_len = prog->len;
+
+	if (write_all(fd, &header, sizeof(header))
+	    || write_all(fd, prog->code, prog->len))
+		return -1;
+
+	return 0;
+}
+
+int map_program(int fd, struct Program *prog)
+{
+	const struct PayloadHeader *header;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+	if ((size_t)st.st_size < sizeof(struct PayloadHeader)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	header = map;
+	memset(prog, 0, sizeof(struct Program));
+	prog->image = map;
+	prog->image_len = st.st_size;
+	if (memcmp(header->magic, PAYLOAD_MAGIC, sizeof(header->magic)) != 0
+	    || header->version != PAYLOAD_VERSION
+	    || (header->format != REPORT_BOOT && header->format != REPORT_NKRO)
+	    || header->code_len != st.st_size - sizeof(struct PayloadHeader)) {
+		free_program(prog);
+		errno = EINVAL;
+		return -1;
+	}
+
+	prog->format = header->format;
+	prog->report_size = report_size(header->format);
+	prog->flags = header->flags;
+	prog->code = (unsigned char *)map + sizeof(struct PayloadHeader);
+	prog->len = prog->cap = header->code_len;
+
+	if (check_program(prog)) {
+		free_program(prog);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
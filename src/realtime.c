@@ -0,0 +1,78 @@
+/*
+ * Running with real-time priority.
+ */
+
+// for sched_setaffinity()
+#define _GNU_SOURCE
+
+#include "realtime.h"
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Writes a byte to every page of a block. The stores are volatile, so the
+ * compiler cannot drop them even though nothing reads the block back.
+ */
+static void touch_pages(volatile char *block, size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < len; i += page)
+		block[i] = 0;
+	if (len > 0)
+		block[len - 1] = 0;
+}
+
+/**
+ * Touches a stretch of stack below the caller's frame.
+ */
+static __attribute__((noinline)) void prefault_stack(void)
+{
+	volatile char stack[RT_PREFAULT_STACK];
+
+	touch_pages(stack, sizeof(stack));
+}
+
+int rt_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		return -1;
+
+	// keep freed heap resident, and serve large blocks from it too
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	char *heap = malloc(RT_PREFAULT_HEAP);
+	if (heap == NULL)
+		return -1;
+	touch_pages(heap, RT_PREFAULT_HEAP);
+	free(heap);
+
+	prefault_stack();
+	return 0;
+}
+
+int rt_set_priority(int priority)
+{
+	struct sched_param param = {.sched_priority = priority};
+
+	return sched_setscheduler(0, SCHED_FIFO, &param);
+}
+
+int rt_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
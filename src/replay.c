@@ -0,0 +1,162 @@
+/*
+ * Replays a capture file to a HID gadget with the timing it was recorded
+ * with. Nothing is parsed and no layout is loaded: records go straight from
+ * the mapped capture to the output.
+ */
+
+#include "capture.h"
+#include "output.h"
+#include "type.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ERR_REPLAY_USAGE                                                       \
+	"usage: ./replay -c <capture> [-o /dev/hidgX] [-x <factor>] "          \
+	"[-t <ms>] [-S] [-u] [-p]"
+#define ERR_CANNOT_OPEN_CAPTURE "Error opening capture file"
+
+/**
+ * Records closer together than this are written as one run, as they were
+ * when recorded
+ */
+#define REPLAY_RUN_NS 50000
+
+/**
+ * Writes out the records of a capture. Runs of records start as far apart
+ * as they were recorded, times factor; where times go back, as where a
+ * capture holds several recordings, the next run starts right away.
+ *
+ * @param cap capture to replay
+ * @param factor factor to scale the time between runs by
+ * @param out output to write the reports to
+ */
+static void replay(const struct Capture *cap, double factor,
+		   struct HidOut *out)
+{
+	size_t size = cap->header->report_size;
+	char reports[HID_OUT_BATCH * CAPTURE_MAX_REPORT];
+	uint64_t prev = cap->count > 0 ? capture_record(cap, 0)->time : 0;
+	size_t i = 0;
+
+	while (i < cap->count) {
+		const struct CaptureRecord *first = capture_record(cap, i);
+
+		if (first->time > prev
+		    && hid_out_delay_ns(out, (first->time - prev) * factor))
+			abort_output(out);
+		prev = first->time;
+
+		// record the source again if the output is a capture itself
+		out->line = first->line;
+		out->cmd = first->cmd;
+
+		size_t n = 0;
+		for (; i < cap->count && n < HID_OUT_BATCH; i++, n++) {
+			const struct CaptureRecord *rec = capture_record(cap, i);
+			if (rec->time < first->time
+			    || rec->time - first->time >= REPLAY_RUN_NS)
+				break;
+			memcpy(reports + n * size, rec->report, size);
+		}
+
+		if (hid_out_write(out, reports, n))
+			abort_output(out);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char *capture_path = NULL, *outfile_path = DEFAULT_OUTPUT_FILE;
+	bool stats = false, uring = false, pipeline = false;
+	int timeout = -1;
+	double factor = 1;
+	struct Capture cap;
+	struct HidOut *out;
+
+	int optchar;
+	while ((optchar = getopt(argc, argv, "c:o:x:t:Sup")) != -1) {
+		switch (optchar) {
+		case 'c':
+			capture_path = optarg;
+			break;
+		case 'o':
+			outfile_path = optarg;
+			break;
+		case 'x': {
+			// scale the time between reports
+			char *end;
+			errno = 0;
+			factor = strtod(optarg, &end);
+			if (end == optarg || *end != '\0' || errno == ERANGE
+			    || !isfinite(factor) || factor < 0)
+				err(ERR_REPLAY_USAGE, false, true);
+			break;
+		}
+		case 't': {
+			long ms;
+			if (parse_arg(optarg, 1, INT_MAX, &ms))
+				err(ERR_REPLAY_USAGE, false, true);
+			timeout = ms;
+			break;
+		}
+		case 'S':
+			stats = true;
+			break;
+		case 'u':
+			uring = true;
+			break;
+		case 'p':
+			pipeline = true;
+			break;
+		default:
+			err(ERR_REPLAY_USAGE, false, true);
+		}
+	}
+
+	if (capture_path == NULL)
+		err(ERR_REPLAY_USAGE, false, true);
+
+	int fd = open(capture_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || map_capture(fd, &cap))
+		err(ERR_CANNOT_OPEN_CAPTURE, true, true);
+	close(fd);
+
+	size_t report_size = cap.header->report_size;
+	out = NULL;
+	if (uring) {
+		out = hid_out_open_uring(outfile_path, report_size);
+		if (out == NULL && errno != ENOSYS && errno != EPERM)
+			err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+		if (out == NULL)
+			err(ERR_NO_URING, false, false);
+	}
+	if (out == NULL)
+		out = hid_out_open(outfile_path, report_size);
+	if (out == NULL || hid_out_set_timeout(out, timeout))
+		err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+	if (pipeline) {
+		struct HidOut *pipe = hid_out_pipeline(out);
+		if (pipe == NULL)
+			err(ERR_CANNOT_OPEN_OUTFILE, true, true);
+		out = pipe;
+	}
+
+	replay(&cap, factor, out);
+	if (hid_out_flush(out))
+		abort_output(out);
+
+	if (stats && out->reports > 0)
+		fprintf(stderr, "%lu reports in %lu syscalls (%.2f per report)\n",
+			out->reports, out->syscalls,
+			(double)out->syscalls / out->reports);
+
+	unmap_capture(&cap);
+	hid_out_close(out);
+
+	return EXIT_SUCCESS;
+}
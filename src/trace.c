@@ -0,0 +1,124 @@
+/*
+ * Trace output on a virtual clock.
+ *
+ * Nothing is sent to a device and nothing sleeps: pauses move a virtual
+ * clock forward, and every report is written out as a line of text stamped
+ * with the virtual time it would have been sent at. A script that takes an
+ * hour to type is traced in milliseconds, which makes this the output for
+ * checking scripts and estimating how long they take.
+ *
+ * Each line holds the time in milliseconds, then the report in hex:
+ *
+ *     30000.000 02 00 04 00 00 00 00 00
+ */
+
+#include "output.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NS_PER_MS 1000000LL
+
+struct TraceOut {
+	// must come first, see hid_out_close()
+	struct HidOut out;
+	// buffered stream on a duplicate of the descriptor
+	FILE *file;
+};
+
+static int trace_write(struct HidOut *out, const char *reports, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct TraceOut *t = (struct TraceOut *)out;
+
+	for (size_t i = 0; i < n; i++) {
+		const unsigned char *report =
+			(const unsigned char *)reports + i * out->report_size;
+		char line[3 * HID_OUT_MAX_REPORT + 1];
+		char *p = line;
+
+		for (size_t b = 0; b < out->report_size; b++) {
+			*p++ = ' ';
+			*p++ = hex[report[b] >> 4];
+			*p++ = hex[report[b] & 0xF];
+		}
+		*p++ = '\n';
+
+		fprintf(t->file, "%lld.%03lld", out->due / NS_PER_MS,
+			out->due % NS_PER_MS / 1000);
+		fwrite(line, 1, p - line, t->file);
+
+		// with a rate set, reports take up time
+		out->due += out->interval;
+	}
+
+	if (ferror(t->file)) {
+		errno = EIO;
+		return -1;
+	}
+
+	out->reports += n;
+	return 0;
+}
+
+static int trace_delay(struct HidOut *out, long long ns)
+{
+	out->due += ns;
+	return 0;
+}
+
+static int trace_flush(struct HidOut *out)
+{
+	struct TraceOut *t = (struct TraceOut *)out;
+
+	return fflush(t->file) == EOF ? -1 : 0;
+}
+
+static void trace_close(struct HidOut *out)
+{
+	struct TraceOut *t = (struct TraceOut *)out;
+
+	fclose(t->file);
+}
+
+static const struct HidOutOps trace_ops = {
+	.write = trace_write,
+	.delay = trace_delay,
+	.flush = trace_flush,
+	.abort = NULL,
+	.close = trace_close,
+};
+
+struct HidOut *hid_out_trace_fdopen(int fd, size_t report_size)
+{
+	struct TraceOut *t;
+
+	if (report_size > HID_OUT_MAX_REPORT) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	t = calloc(1, sizeof(struct TraceOut));
+	if (t == NULL)
+		return NULL;
+
+	// the stream closes its own descriptor, the output's stays open
+	int dup_fd = dup(fd);
+	if (dup_fd < 0 || (t->file = fdopen(dup_fd, "w")) == NULL) {
+		int saved = errno;
+		if (dup_fd >= 0)
+			close(dup_fd);
+		free(t);
+		errno = saved;
+		return NULL;
+	}
+
+	t->out.ops = &trace_ops;
+	t->out.fd = fd;
+	t->out.report_size = report_size;
+	t->out.timeout = -1;
+	t->out.max_latency = -1;
+
+	return &t->out;
+}
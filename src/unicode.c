@@ -2,6 +2,10 @@
 #include "unicode.h"
 #include <string.h>
 
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
 /* UTF-8 decoder */
 
 // Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
@@ -39,11 +43,96 @@ uint32_t decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
 }
 
 uint32_t getCodepoint(char *string, int *index) {
-  uint32_t codepoint = 0;
-  uint32_t state = UTF8_ACCEPT;
+  uint32_t codepoint;
+  size_t i = *index;
 
-  while(decode(&state, &codepoint, (unsigned char) string[(*index)++]))
-    if (state == UTF8_REJECT) return 0;
+  // a code sequence is at most 4 bytes, and a NUL ends the string
+  if (next_codepoint(string, i + strnlen(string + i, 4), &i, &codepoint)) {
+    (*index)++;
+    return 0;
+  }
 
+  *index = i;
   return codepoint;
 }
+
+int next_codepoint(const char *string, size_t len, size_t *index,
+                   uint32_t *codepoint) {
+  uint32_t state = UTF8_ACCEPT;
+  size_t i = *index;
+
+  *codepoint = 0;
+  do {
+    if (i >= len) return -1;
+    if (decode(&state, codepoint, (unsigned char) string[i++]) == UTF8_REJECT)
+      return -1;
+  } while (state != UTF8_ACCEPT);
+
+  *index = i;
+  return 0;
+}
+
+/**
+ * Returns the length of the run of ASCII bytes at the start of a buffer,
+ * checking 16 bytes at a time with SSE2 where available and 8 at a time
+ * otherwise.
+ */
+static size_t ascii_prefix(const char *string, size_t len) {
+  size_t i = 0;
+
+#ifdef __x86_64__
+  for (; len - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (string + i));
+    int high = _mm_movemask_epi8(v);
+    if (high) return i + __builtin_ctz(high);
+  }
+#endif
+  for (; len - i >= 8; i += 8) {
+    uint64_t word;
+    memcpy(&word, string + i, sizeof(word));
+    if (word & 0x8080808080808080ull) break;
+  }
+  while (i < len && !(string[i] & 0x80)) i++;
+
+  return i;
+}
+
+int utf8_validate(const char *string, size_t len, size_t *error) {
+  size_t i = 0;
+
+  while ((i += ascii_prefix(string + i, len - i)) < len) {
+    uint32_t codepoint;
+    size_t start = i;
+
+    if (next_codepoint(string, len, &i, &codepoint)) {
+      if (error != NULL) *error = start;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+ssize_t utf8_decode(const char *string, size_t len, uint32_t *codepoints,
+                    size_t *error) {
+  size_t i = 0, n = 0;
+
+  while (i < len) {
+    // widen runs of ASCII directly, decode everything else
+    size_t ascii = ascii_prefix(string + i, len - i);
+    for (size_t j = 0; j < ascii; j++)
+      codepoints[n++] = (unsigned char) string[i + j];
+    i += ascii;
+
+    if (i < len) {
+      size_t start = i;
+      if (next_codepoint(string, len, &i, &codepoints[n])) {
+        if (error != NULL) *error = start;
+        return -1;
+      }
+      n++;
+    }
+  }
+
+  return n;
+}
@@ -0,0 +1,608 @@
+/*
+ * io_uring backend for report output.
+ *
+ * Every report becomes an IORING_OP_WRITE and every pause an
+ * IORING_OP_TIMEOUT, linked into one chain so that the kernel runs them
+ * strictly in order. A chain ends with each submission; the first entry of
+ * the next submission is marked IOSQE_IO_DRAIN, so it does not start before
+ * everything submitted earlier is done.
+ *
+ * With a deadline set, every write is followed by an IORING_OP_LINK_TIMEOUT,
+ * which cancels the write if the device does not take the report in time.
+ * The kernel only arms a deadline that ends its chain, so the entry after
+ * it starts a new chain and is marked IOSQE_IO_DRAIN as well.
+ * With a rate set, every write is followed by a pause of the time between
+ * reports.
+ *
+ * Entries own a slot holding their report or timespec until they complete.
+ * Errors are picked up from the completion queue and returned by the next
+ * call. On abort, everything in flight is canceled, and waited for, before
+ * the all-keys-up report is written. Kernels that cannot cancel from outside
+ * the ring get until the deadline to finish the writes instead.
+ *
+ * liburing is not used; the ring is set up with the raw syscalls.
+ */
+
+#include "output.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(IORING_TIMEOUT_ETIME_SUCCESS) && defined(IORING_FEAT_CQE_SKIP)
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Entries in the submission queue, and most entries in flight */
+#define URING_ENTRIES 128
+
+/**
+ * Data that has to stay put until the kernel is done with an entry.
+ */
+struct UringSlot {
+	union {
+		char report[HID_OUT_MAX_REPORT];
+		struct __kernel_timespec ts;
+	};
+	// whether the entry has been queued and not completed yet
+	bool busy;
+	// IORING_OP_WRITE, IORING_OP_TIMEOUT or IORING_OP_LINK_TIMEOUT
+	unsigned char opcode;
+};
+
+struct UringOut {
+	// must come first, see hid_out_close()
+	struct HidOut out;
+	int ring_fd;
+	// mappings of the rings
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	// submission queue
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	// completion queue
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	// entries queued but not submitted yet
+	unsigned pending;
+	// entries submitted but not completed yet
+	unsigned inflight;
+	// next slot to use
+	unsigned next;
+	// whether the entry queued last links to the next one
+	bool linked;
+	// errno of the first failed entry, 0 if none
+	int error;
+	struct UringSlot slots[URING_ENTRIES];
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(struct UringOut *u, unsigned submit, unsigned wait)
+{
+	u->out.syscalls++;
+	return syscall(__NR_io_uring_enter, u->ring_fd, submit, wait,
+		       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * Takes every completion off the queue and frees its slot.
+ */
+static void reap(struct UringOut *u)
+{
+	unsigned head = *u->cq_head;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct UringSlot *slot = &u->slots[cqe->user_data];
+		int res = cqe->res;
+
+		switch (slot->opcode) {
+		case IORING_OP_WRITE:
+			if (res >= 0 && (size_t)res != u->out.report_size)
+				res = -EIO;
+			// the deadline ran out and canceled the write
+			if ((res == -ECANCELED || res == -EINTR)
+			    && u->out.timeout >= 0)
+				res = -ETIMEDOUT;
+			break;
+		case IORING_OP_TIMEOUT:
+			// a pause completes with -ETIME when it runs out
+			if (res == -ETIME)
+				res = 0;
+			break;
+		case IORING_OP_LINK_TIMEOUT:
+			// a deadline is canceled when its write makes it, and
+			// runs out otherwise
+			res = res == -ETIME ? -ETIMEDOUT : 0;
+			break;
+		}
+		if (res < 0 && u->error == 0)
+			u->error = -res;
+
+		slot->busy = false;
+		u->inflight--;
+		head++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Marks the first entry the kernel has not taken yet IOSQE_IO_DRAIN. The
+ * kernel ends a chain with each submission, so after a partial one, the
+ * rest starts a new chain that has to wait for the old one.
+ */
+static void drain_rest(struct UringOut *u)
+{
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	u->sqes[u->sq_array[head & *u->sq_mask]].flags |= IOSQE_IO_DRAIN;
+}
+
+/**
+ * Submits the queued entries, then waits until at most max_inflight
+ * entries are left in flight.
+ */
+static int submit(struct UringOut *u, unsigned max_inflight)
+{
+	while (u->pending > 0) {
+		int ret = uring_enter(u, u->pending, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				reap(u);
+				continue;
+			}
+			return -1;
+		}
+		u->pending -= ret;
+		u->inflight += ret;
+		if (ret > 0 && u->pending > 0)
+			drain_rest(u);
+	}
+	u->linked = false;
+
+	reap(u);
+	while (u->inflight > max_inflight) {
+		if (uring_enter(u, 0, u->inflight - max_inflight) < 0
+		    && errno != EINTR)
+			return -1;
+		reap(u);
+	}
+
+	return 0;
+}
+
+/**
+ * Waits until the next n slots are free.
+ */
+static int reserve(struct UringOut *u, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		while (u->slots[(u->next + i) % URING_ENTRIES].busy) {
+			if (submit(u, u->inflight + u->pending - 1))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Queues an entry and returns it, with its slot in user_data. Waits for a
+ * free slot if needed.
+ */
+static struct io_uring_sqe *queue(struct UringOut *u, struct UringSlot **slot)
+{
+	if (reserve(u, 1))
+		return NULL;
+
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = u->next;
+	sqe->flags = IOSQE_IO_LINK;
+	// the first entry of a chain waits for the previous ones
+	if (!u->linked && u->pending + u->inflight > 0)
+		sqe->flags |= IOSQE_IO_DRAIN;
+	u->linked = true;
+
+	*slot = &u->slots[u->next];
+	(*slot)->busy = true;
+	u->next = (u->next + 1) % URING_ENTRIES;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->pending++;
+
+	return sqe;
+}
+
+/**
+ * Returns the error of a failed entry, if any, with errno set.
+ */
+static int check_error(struct UringOut *u)
+{
+	if (u->error == 0)
+		return 0;
+
+	errno = u->error;
+	return -1;
+}
+
+/**
+ * Queues a deadline for the write queued last, which it must directly
+ * follow in the same submission.
+ */
+static int queue_deadline(struct UringOut *u)
+{
+	struct UringSlot *slot;
+	struct io_uring_sqe *sqe = queue(u, &slot);
+
+	if (sqe == NULL)
+		return -1;
+
+	slot->opcode = IORING_OP_LINK_TIMEOUT;
+	slot->ts.tv_sec = u->out.timeout / 1000;
+	slot->ts.tv_nsec = (u->out.timeout % 1000) * 1000000L;
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->flags &= ~IOSQE_IO_LINK;
+	sqe->addr = (uintptr_t)&slot->ts;
+	sqe->len = 1;
+	u->linked = false;
+
+	return 0;
+}
+
+/**
+ * Queues a pause of ns nanoseconds.
+ */
+static int queue_pause(struct UringOut *u, long long ns)
+{
+	struct UringSlot *slot;
+	struct io_uring_sqe *sqe = queue(u, &slot);
+
+	if (sqe == NULL)
+		return -1;
+
+	slot->opcode = IORING_OP_TIMEOUT;
+	slot->ts.tv_sec = ns / 1000000000;
+	slot->ts.tv_nsec = ns % 1000000000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t)&slot->ts;
+	sqe->len = 1;
+	sqe->off = 0;
+	// keep the chain going when the timeout runs out
+	sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+
+	return 0;
+}
+
+static int uring_write(struct HidOut *out, const char *reports, size_t n)
+{
+	struct UringOut *u = (struct UringOut *)out;
+
+	reap(u);
+
+	for (size_t i = 0; i < n; i++) {
+		bool deadline = out->timeout >= 0;
+		struct UringSlot *slot;
+		struct io_uring_sqe *sqe;
+
+		// a deadline goes in the same submission as its write; waiting
+		// for room may turn up an earlier failure
+		if (reserve(u, 1 + deadline + (out->interval > 0))
+		    || check_error(u) || (sqe = queue(u, &slot)) == NULL)
+			return -1;
+
+		slot->opcode = IORING_OP_WRITE;
+		memcpy(slot->report, reports + i * out->report_size,
+		       out->report_size);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = out->fd;
+		sqe->addr = (uintptr_t)slot->report;
+		sqe->len = out->report_size;
+		sqe->off = -1;
+
+		if (deadline && queue_deadline(u))
+			return -1;
+		if (out->interval > 0 && queue_pause(u, out->interval))
+			return -1;
+	}
+
+	out->reports += n;
+	return submit(u, URING_ENTRIES);
+}
+
+static int uring_delay(struct HidOut *out, long long ns)
+{
+	struct UringOut *u = (struct UringOut *)out;
+
+	reap(u);
+	if (check_error(u) || queue_pause(u, ns))
+		return -1;
+
+	return submit(u, URING_ENTRIES);
+}
+
+static int uring_flush(struct HidOut *out)
+{
+	struct UringOut *u = (struct UringOut *)out;
+
+	// nothing is left to flush once an abort has torn the ring down
+	if (u->ring_fd < 0)
+		return 0;
+	if (submit(u, 0))
+		return -1;
+
+	return check_error(u);
+}
+
+static void uring_close(struct HidOut *out)
+{
+	struct UringOut *u = (struct UringOut *)out;
+
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+	if (u->sq_ptr != NULL)
+		munmap(u->sq_ptr, u->sq_len);
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+}
+
+/**
+ * Returns whether the kernel canceled, or had nothing to cancel, on a
+ * request to cancel everything in flight. Kernels before 6.0, and headers
+ * that predate it, have no such request.
+ */
+static bool sync_cancel(struct UringOut *u)
+{
+#ifdef IORING_SETUP_SINGLE_ISSUER
+	struct io_uring_sync_cancel_reg reg = {
+		.flags = IORING_ASYNC_CANCEL_ANY,
+		.timeout = {.tv_sec = -1, .tv_nsec = -1},
+	};
+
+	u->out.syscalls++;
+	return syscall(__NR_io_uring_register, u->ring_fd,
+		       IORING_REGISTER_SYNC_CANCEL, &reg, 1)
+		       == 0
+	       || errno == ENOENT || errno == EALREADY || errno == EINTR;
+#else
+	(void)u;
+	return false;
+#endif
+}
+
+/**
+ * Waits up to ms milliseconds for completions, and takes them off the
+ * queue.
+ */
+static int wait_completions(struct UringOut *u, int ms)
+{
+	struct pollfd pfd = {.fd = u->ring_fd, .events = POLLIN};
+
+	u->out.syscalls++;
+	if (poll(&pfd, 1, ms) < 0 && errno != EINTR)
+		return -1;
+
+	reap(u);
+	return 0;
+}
+
+/**
+ * Drops the entries not submitted yet, cancels those in flight and waits
+ * for all of them to complete, so that no report queued earlier can reach
+ * the device after the all-keys-up report.
+ *
+ * Where the kernel cannot cancel them, writes in flight are waited for, for
+ * no longer than the output's deadline or, without one,
+ * HID_OUT_ABORT_TIMEOUT: without a deadline of their own, writes the host
+ * does not read would never complete.
+ *
+ * @return 0 once nothing is in flight, -1 with errno set to ETIMEDOUT if
+ *  writes are still in flight at the deadline
+ */
+static int cancel_all(struct UringOut *u)
+{
+	int ms = u->out.timeout < 0 ? HID_OUT_ABORT_TIMEOUT : u->out.timeout;
+	bool cancel = true;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + ms;
+
+	// the kernel has not looked at these yet
+	for (; u->pending > 0; u->pending--) {
+		u->next = (u->next + URING_ENTRIES - 1) % URING_ENTRIES;
+		u->slots[u->next].busy = false;
+		(*u->sq_tail)--;
+	}
+	u->linked = false;
+
+	reap(u);
+	while (u->inflight > 0) {
+		// entries waiting to be drained only start once those before
+		// them are gone, so cancel until nothing is left
+		if (cancel && (cancel = sync_cancel(u))) {
+			if (submit(u, u->inflight - 1))
+				return -1;
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long long left =
+			deadline - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (wait_completions(u, left))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Cancels everything in flight, tears the ring down and goes on with
+ * synchronous writes.
+ */
+static int uring_abort(struct HidOut *out)
+{
+	struct UringOut *u = (struct UringOut *)out;
+	int ret = cancel_all(u);
+	int saved = errno;
+
+	// closing the ring has the kernel cancel whatever is left
+	uring_close(out);
+	u->sq_ptr = u->cq_ptr = NULL;
+	u->sqes = NULL;
+	u->ring_fd = -1;
+
+	// a report still in flight could land after the all-keys-up one
+	if (ret) {
+		errno = saved;
+		return -1;
+	}
+
+	return hid_out_abort_fd(out);
+}
+
+static const struct HidOutOps uring_ops = {
+	.write = uring_write,
+	.delay = uring_delay,
+	.flush = uring_flush,
+	.abort = uring_abort,
+	.close = uring_close,
+};
+
+/**
+ * Maps the rings of a new io_uring instance.
+ */
+static int map_rings(struct UringOut *u, const struct io_uring_params *p)
+{
+	int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+
+	u->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	u->cq_len = p->cq_off.cqes
+		    + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_len, prot, flags, u->ring_fd,
+			 IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		u->sq_ptr = NULL;
+		return -1;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_len, prot, flags, u->ring_fd,
+				 IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			return -1;
+		}
+	}
+
+	u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, prot, flags, u->ring_fd,
+		       IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -1;
+	}
+
+	char *sq = u->sq_ptr, *cq = u->cq_ptr;
+	u->sq_head = (unsigned *)(sq + p->sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p->sq_off.array);
+	u->cq_head = (unsigned *)(cq + p->cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+struct HidOut *hid_out_uring_fdopen(int fd, size_t report_size)
+{
+	struct io_uring_params p;
+
+	if (report_size > HID_OUT_MAX_REPORT) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (set_blocking(fd, true))
+		return NULL;
+
+	struct UringOut *u = calloc(1, sizeof(struct UringOut));
+	if (u == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = uring_setup(URING_ENTRIES, &p);
+	if (u->ring_fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	// timeouts that do not break the chain came with 5.16, this with 5.17
+	if (!(p.features & IORING_FEAT_CQE_SKIP)) {
+		close(u->ring_fd);
+		free(u);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	if (map_rings(u, &p)) {
+		int saved = errno;
+		uring_close(&u->out);
+		free(u);
+		errno = saved;
+		return NULL;
+	}
+
+	u->out.ops = &uring_ops;
+	u->out.fd = fd;
+	u->out.report_size = report_size;
+	u->out.timeout = -1;
+	// the kernel keeps the schedule
+	u->out.max_latency = -1;
+
+	return &u->out;
+}
+
+#else
+
+struct HidOut *hid_out_uring_fdopen(int fd, size_t report_size)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Runs programs compiled by compile.c.
+ *
+ * All parsing and encoding happened at compile time: between reports, the
+ * VM only decodes an opcode and its operands.
+ */
+
+#include "program.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t read_u32(const unsigned char **pc)
+{
+	uint32_t n;
+
+	memcpy(&n, *pc, sizeof(n));
+	*pc += sizeof(n);
+	return n;
+}
+
+/**
+ * Unpacks reports packed as described in program.h and writes them out in
+ * batches.
+ *
+ * @param prog program the reports belong to
+ * @param packed packed reports
+ * @param len length of the packed reports
+ * @param n number of reports they unpack to
+ * @param out output to write reports to, or NULL to only check them
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int emit_packed(const struct Program *prog,
+		       const unsigned char *packed, size_t len, uint32_t n,
+		       struct HidOut *out)
+{
+	size_t size = prog->report_size;
+	// reports unpacked so far, the last PACK_MAX_PERIOD of them
+	char history[PACK_MAX_PERIOD][HID_OUT_MAX_REPORT];
+	char batch[HID_OUT_BATCH * HID_OUT_MAX_REPORT];
+	char report[HID_OUT_MAX_REPORT] = {0};
+	const unsigned char *p = packed, *end = packed + len;
+	size_t done = 0, queued = 0;
+
+	while (p < end) {
+		size_t count = 1, period = 0;
+
+		if (*p == PACK_RUN) {
+			if (end - p < 3)
+				goto malformed;
+			period = p[1];
+			count = (size_t)p[2] * period;
+			if (period == 0 || period > PACK_MAX_PERIOD
+			    || period > done)
+				goto malformed;
+			p += 3;
+		} else {
+			size_t pairs = *p++;
+			if (pairs > size || (size_t)(end - p) < 2 * pairs)
+				goto malformed;
+			for (; pairs > 0; pairs--, p += 2) {
+				if (p[0] >= size)
+					goto malformed;
+				report[p[0]] = p[1];
+			}
+		}
+
+		if (count > n - done)
+			goto malformed;
+		for (; count > 0; count--) {
+			if (period != 0)
+				memcpy(report,
+				       history[(done - period) % PACK_MAX_PERIOD],
+				       size);
+			memcpy(history[done % PACK_MAX_PERIOD], report, size);
+			memcpy(batch + queued * size, report, size);
+			done++;
+			if (++queued == HID_OUT_BATCH) {
+				if (out != NULL
+				    && hid_out_write(out, batch, queued))
+					return -1;
+				queued = 0;
+			}
+		}
+	}
+
+	if (done != n)
+		goto malformed;
+	if (out != NULL && queued > 0 && hid_out_write(out, batch, queued))
+		return -1;
+	return 0;
+
+malformed:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Runs a stretch of code.
+ *
+ * @param prog program the code belongs to
+ * @param start first instruction
+ * @param end end of the last instruction
+ * @param defdelay default delay, in and out
+ * @param out output to write reports to
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int run_code(const struct Program *prog, const unsigned char *start,
+		    const unsigned char *end, long *defdelay,
+		    struct HidOut *out)
+{
+	const unsigned char *pc = start;
+
+	while (pc < end) {
+		const unsigned char *insn = pc;
+		unsigned char op = *pc++;
+
+		switch (op) {
+		case OP_EMIT: {
+			if (end - pc < (long)sizeof(uint32_t))
+				goto malformed;
+			uint32_t n = read_u32(&pc);
+			if ((size_t)(end - pc) / prog->report_size < n)
+				goto malformed;
+			if (hid_out_write(out, (const char *)pc, n))
+				return -1;
+			pc += n * prog->report_size;
+			break;
+		}
+		case OP_EMIT_PACKED: {
+			if (end - pc < 2 * (long)sizeof(uint32_t))
+				goto malformed;
+			uint32_t n = read_u32(&pc);
+			uint32_t len = read_u32(&pc);
+			if ((size_t)(end - pc) < len)
+				goto malformed;
+			if (emit_packed(prog, pc, len, n, out))
+				return -1;
+			pc += len;
+			break;
+		}
+		case OP_DELAY:
+			if (end - pc < (long)sizeof(uint32_t))
+				goto malformed;
+			if (hid_out_delay(out, (int32_t)read_u32(&pc)))
+				return -1;
+			break;
+		case OP_DEFAULT_DELAY:
+			if (hid_out_delay(out, *defdelay))
+				return -1;
+			break;
+		case OP_SET_DEFAULT_DELAY:
+			if (end - pc < (long)sizeof(uint32_t))
+				goto malformed;
+			*defdelay = (int32_t)read_u32(&pc);
+			break;
+		case OP_LOOP: {
+			if (end - pc < 3 * (long)sizeof(uint32_t))
+				goto malformed;
+			uint32_t count = read_u32(&pc);
+			uint32_t body = read_u32(&pc);
+			uint32_t len = read_u32(&pc);
+
+			// loops only go back, so they always come to an end
+			if (body > insn - prog->code
+			    || len > insn - prog->code - body)
+				goto malformed;
+			for (uint32_t i = 0; i < count; i++)
+				if (run_code(prog, prog->code + body,
+					     prog->code + body + len, defdelay,
+					     out))
+					return -1;
+			break;
+		}
+		case OP_SOURCE:
+			if (end - pc < 2 * (long)sizeof(uint32_t))
+				goto malformed;
+			out->line = read_u32(&pc);
+			out->cmd = read_u32(&pc);
+			break;
+		default:
+			goto malformed;
+		}
+	}
+
+	return 0;
+
+malformed:
+	errno = EINVAL;
+	return -1;
+}
+
+static bool is_insn(const unsigned char *starts, size_t off)
+{
+	return starts[off / 8] & (1 << off % 8);
+}
+
+/**
+ * Tells whether any of the loops found so far starts in [from, to).
+ *
+ * @param loops offsets of the loops, in increasing order
+ * @param n number of loops
+ */
+static bool has_loop(const uint32_t *loops, size_t n, size_t from, size_t to)
+{
+	size_t lo = 0, hi = n;
+
+	// find the first loop at or after from
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (loops[mid] < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < n && loops[lo] < to;
+}
+
+int check_program(const struct Program *prog)
+{
+	const unsigned char *pc = prog->code, *end = prog->code + prog->len;
+	// offsets that instructions start at, with the end of the code
+	unsigned char *starts = calloc(prog->len / 8 + 1, 1);
+	// offsets of the loops, each at least an opcode and three operands
+	uint32_t *loops = malloc((prog->len / (1 + 3 * sizeof(uint32_t)) + 1)
+				 * sizeof(uint32_t));
+	size_t nloops = 0;
+
+	if (starts == NULL || loops == NULL) {
+		free(starts);
+		free(loops);
+		return -1;
+	}
+
+	while (pc < end) {
+		const unsigned char *insn = pc;
+		size_t off = insn - prog->code;
+		// operands, and the reports that follow them
+		size_t operands, data = 0;
+
+		starts[off / 8] |= 1 << off % 8;
+		switch (*pc++) {
+		case OP_DEFAULT_DELAY:
+			operands = 0;
+			break;
+		case OP_EMIT:
+		case OP_DELAY:
+		case OP_SET_DEFAULT_DELAY:
+			operands = 1;
+			break;
+		case OP_EMIT_PACKED:
+		case OP_SOURCE:
+			operands = 2;
+			break;
+		case OP_LOOP:
+			operands = 3;
+			break;
+		default:
+			goto malformed;
+		}
+
+		if ((size_t)(end - pc) < operands * sizeof(uint32_t))
+			goto malformed;
+
+		if (*insn == OP_EMIT) {
+			uint32_t n = read_u32(&pc);
+			if ((size_t)(end - pc) / prog->report_size < n)
+				goto malformed;
+			data = n * prog->report_size;
+		} else if (*insn == OP_EMIT_PACKED) {
+			uint32_t n = read_u32(&pc);
+			data = read_u32(&pc);
+			// unpack them without an output, so that a bad record
+			// is found before the first report is sent
+			if ((size_t)(end - pc) < data
+			    || emit_packed(prog, pc, data, n, NULL))
+				goto malformed;
+		} else if (*insn == OP_LOOP) {
+			pc += sizeof(uint32_t);
+			uint32_t body = read_u32(&pc);
+			uint32_t len = read_u32(&pc);
+			// the body is whole instructions from before the loop,
+			// with no loop among them: nested loops would recurse
+			// in run_code() and multiply the run time at each level
+			if (body > off || len > off - body
+			    || !is_insn(starts, body)
+			    || !is_insn(starts, body + len)
+			    || has_loop(loops, nloops, body, body + len))
+				goto malformed;
+			loops[nloops++] = off;
+		} else {
+			pc += operands * sizeof(uint32_t);
+		}
+
+		if ((size_t)(end - pc) < data)
+			goto malformed;
+		pc += data;
+	}
+
+	free(starts);
+	free(loops);
+	return 0;
+
+malformed:
+	free(starts);
+	free(loops);
+	errno = EINVAL;
+	return -1;
+}
+
+int run_program(const struct Program *prog, struct HidOut *out)
+{
+	long defdelay = 0;
+
+	if (prog->report_size != out->report_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return run_code(prog, prog->code, prog->code + prog->len, &defdelay,
+			out);
+}
@@ -4,22 +4,37 @@
 
 #define DEFAULT_LAYOUT "test.layout"
 
+#include "ascii.h"
+#include "cache.h"
+#include "capture.h"
+#include "keywords.h"
 #include "kybdutil.h"
 #include "layouts.h"
+#include "output.h"
+#include "planner.h"
+#include "program.h"
+#include "realtime.h"
+#include "type.h"
 #include "unicode.h"
 #include "unity.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 char *report;
 struct Layout *lo;
+struct KbdCtx ctx;
 
 void setUp()
 {
 	report = calloc((size_t)8, (size_t)1);
 	lo = load_layout(fopen(DEFAULT_LAYOUT, "r"));
-	set_layout(lo);
+	kbd_ctx_init(&ctx, lo);
 }
 
 void tearDown()
@@ -35,28 +50,151 @@ void test_layout_file_loaded()
 	TEST_ASSERT_NOT_NULL(lo);
 }
 
-// test if set_layout has not been called, fail always
+// test if the context has no layout, fail always
 void test_all_fail_when_no_layout_set()
 {
 	int index = 0;
 	char a = 'a';
 	uint32_t codepoint = getCodepoint(&a, &index);
 
-	set_layout(NULL);
+	ctx.layout = NULL;
 
-	TEST_ASSERT_EQUAL(-1, make_hid_report_arr(report, 0, 1, &codepoint));
-	TEST_ASSERT_EQUAL(-1, make_hid_report(report, 0, 1, codepoint));
+	TEST_ASSERT_EQUAL(-1, make_hid_report_arr(&ctx, report, 0, 1, &codepoint));
+	TEST_ASSERT_EQUAL(-1, make_hid_report(&ctx, report, 0, 1, codepoint));
 }
 
 /** basic parameter testing*/
 void test_make_hid_report_arr_nullargs_fails()
 {
-	int result = make_hid_report_arr(report, 0, 1, NULL);
+	int result = make_hid_report_arr(&ctx, report, 0, 1, NULL);
 	TEST_ASSERT_EQUAL_INT(-1, result);
-	result = make_hid_report_arr(report, 1, 1, NULL);
+	result = make_hid_report_arr(&ctx, report, 1, 1, NULL);
 	TEST_ASSERT_EQUAL_INT(-1, result);
 }
 
+// mappings are stored in one cache-line-aligned array
+void test_layout_map_is_aligned()
+{
+	TEST_ASSERT_EQUAL(0, (uintptr_t)lo % LAYOUT_ALIGN);
+	TEST_ASSERT_EQUAL(0, (uintptr_t)lo->map % LAYOUT_ALIGN);
+	TEST_ASSERT_EQUAL_PTR(&lo->map[5], map_codepoint(lo->map[5].ch, lo, false));
+}
+
+// codepoints outside the layout must not map, wherever they fall in the index
+void test_map_codepoint_unmapped()
+{
+	TEST_ASSERT_NULL(map_codepoint(0x00, lo, false));
+	TEST_ASSERT_NULL(map_codepoint(0x1F, lo, false));
+	TEST_ASSERT_NULL(map_codepoint(0x7FF, lo, false));
+	TEST_ASSERT_NULL(map_codepoint(0x1F600, lo, false));
+	TEST_ASSERT_NULL(map_codepoint(0x10FFFF, lo, false));
+	TEST_ASSERT_NULL(map_codepoint(0x110000, lo, false));
+	TEST_ASSERT_NULL(map_codepoint(0xFFFFFFFF, lo, false));
+}
+
+// compiled images map the same codepoints to the same keys
+void test_layout_binary_round_trip()
+{
+	FILE *image = tmpfile();
+	TEST_ASSERT_NOT_NULL(image);
+	TEST_ASSERT_EQUAL(0, save_layout_binary(lo, image));
+	fflush(image);
+	rewind(image);
+
+	struct Layout *bin = load_layout(image);
+	TEST_ASSERT_NOT_NULL(bin);
+	TEST_ASSERT_NOT_NULL(bin->image);
+	TEST_ASSERT_EQUAL(lo->size, bin->size);
+	for (int i = 0; i < lo->size; i++) {
+		const struct Keycode *k = map_codepoint(lo->map[i].ch, bin, false);
+		TEST_ASSERT_NOT_NULL(k);
+		TEST_ASSERT_EQUAL(lo->map[i].id, k->id);
+		TEST_ASSERT_EQUAL(lo->map[i].mod, k->mod);
+	}
+	TEST_ASSERT_NULL(map_codepoint(0x1F600, bin, false));
+
+	destroy_layout(bin);
+	fclose(image);
+}
+
+// truncated or corrupt images are rejected
+void test_layout_binary_rejects_bad_image()
+{
+	FILE *image = tmpfile();
+	TEST_ASSERT_EQUAL(0, save_layout_binary(lo, image));
+	fflush(image);
+	TEST_ASSERT_EQUAL(0, ftruncate(fileno(image), 100));
+	rewind(image);
+	TEST_ASSERT_NULL(load_layout(image));
+	fclose(image);
+}
+
+// layouts built into the program are usable by name
+void test_builtin_layouts()
+{
+	struct Layout *en = load_builtin_layout("en-us");
+	TEST_ASSERT_NOT_NULL(en);
+	const struct Keycode *k = map_codepoint('A', en, false);
+	TEST_ASSERT_NOT_NULL(k);
+	TEST_ASSERT_EQUAL(0x04, k->id);
+	TEST_ASSERT_EQUAL(0x02, k->mod);
+	destroy_layout(en);
+
+	for (int i = 0; builtin_layouts[i].name != NULL; i++) {
+		struct Layout *bl = load_builtin_layout(builtin_layouts[i].name);
+		TEST_ASSERT_NOT_NULL(bl);
+		destroy_layout(bl);
+	}
+
+	TEST_ASSERT_NULL(load_builtin_layout("no-such-layout"));
+}
+
+// keyword lookup finds commands, escapes and their aliases, and nothing else
+void test_lookup_keyword()
+{
+	const struct Keyword *kw = lookup_keyword("STRING", 6);
+	TEST_ASSERT_NOT_NULL(kw);
+	TEST_ASSERT_EQUAL(KW_COMMAND, kw->type);
+	TEST_ASSERT_EQUAL(CMD_STRING, kw->value);
+
+	TEST_ASSERT_EQUAL(CMD_REM, lookup_keyword("#", 1)->value);
+	TEST_ASSERT_EQUAL(CMD_DEFAULT_DELAY, lookup_keyword("DEFAULTDELAY", 12)->value);
+	TEST_ASSERT_EQUAL(CMD_DELAY, lookup_keyword("DELAY 100", 5)->value);
+
+	TEST_ASSERT_EQUAL(CONTROL, map_escape("CTRL"));
+	TEST_ASSERT_EQUAL(CONTROL, map_escape("CONTROL"));
+	TEST_ASSERT_EQUAL(GUI, map_escape("WINDOWS"));
+	TEST_ASSERT_EQUAL(MENU, map_escape("APP"));
+	TEST_ASSERT_EQUAL(F12, map_escape("F12"));
+
+	TEST_ASSERT_EQUAL(0, map_escape("STRING"));
+	TEST_ASSERT_EQUAL(0, map_escape("CTR"));
+	TEST_ASSERT_EQUAL(0, map_escape("ctrl"));
+	TEST_ASSERT_EQUAL(0, map_escape(""));
+	TEST_ASSERT_NULL(lookup_keyword("ALTT", 4));
+}
+
+// every escape codepoint has a key, and escape tokens cover the whole page
+void test_escape_table()
+{
+	for (uint32_t esc = 1; esc < ESCAPE_COUNT; esc++) {
+		const struct Keycode *k = map_codepoint(esc, lo, true);
+		TEST_ASSERT_NOT_NULL(k);
+		TEST_ASSERT_EQUAL(esc, k->ch);
+		TEST_ASSERT_TRUE(k->id != 0 || k->mod != 0);
+	}
+	TEST_ASSERT_NULL(map_codepoint(ESCAPE_END, lo, true));
+	TEST_ASSERT_NULL(map_codepoint(ESCAPE_COUNT, lo, true));
+
+	TEST_ASSERT_EQUAL(0x73, map_codepoint(map_escape("F24"), lo, true)->id);
+	TEST_ASSERT_EQUAL(0x62, map_codepoint(map_escape("KP0"), lo, true)->id);
+	TEST_ASSERT_EQUAL(0x64, map_codepoint(map_escape("NONUSBACKSLASH"), lo, true)->id);
+	TEST_ASSERT_EQUAL(0x90, map_codepoint(map_escape("LANG1"), lo, true)->id);
+	TEST_ASSERT_EQUAL(0x87, map_codepoint(map_escape("INTL1"), lo, true)->id);
+	TEST_ASSERT_EQUAL(0x40, map_codepoint(map_escape("RALT"), lo, true)->mod);
+	TEST_ASSERT_EQUAL(0x10, map_codepoint(map_escape("RCTRL"), lo, true)->mod);
+}
+
 void test_make_hid_report_one_char()
 {
 	// test report generation for all codepoints in layout
@@ -65,13 +203,13 @@ void test_make_hid_report_one_char()
 		memset(report, 0x00, (size_t)8);
 
 		// retrieve expected values
-		char id = lo->map[i]->id;
-		char mod = lo->map[i]->mod;
+		char id = lo->map[i].id;
+		char mod = lo->map[i].mod;
 
 		// get codepoint to encode
-		uint32_t codepoint = lo->map[i]->ch;
+		uint32_t codepoint = lo->map[i].ch;
 
-		make_hid_report(report, 0, 1, codepoint);
+		make_hid_report(&ctx, report, 0, 1, codepoint);
 		TEST_ASSERT_EQUAL(mod, report[0]);  // modifier
 		TEST_ASSERT_EQUAL(0x00, report[1]); // reserved
 		TEST_ASSERT_EQUAL(id, report[2]);   // usage id
@@ -91,13 +229,13 @@ void test_make_hid_report_two_chars()
 		memset(report, 0x00, (size_t)8);
 
 		// retrieve expected values
-		char id = lo->map[i]->id;
-		char mod = lo->map[i]->mod;
+		char id = lo->map[i].id;
+		char mod = lo->map[i].mod;
 
 		// get codepoint to encode
-		uint32_t codepoint = lo->map[i]->ch;
+		uint32_t codepoint = lo->map[i].ch;
 
-		make_hid_report(report, 0, 2, codepoint, codepoint);
+		make_hid_report(&ctx, report, 0, 2, codepoint, codepoint);
 		TEST_ASSERT_EQUAL(mod, report[0]);  // modifier
 		TEST_ASSERT_EQUAL(0x00, report[1]); // reserved
 		TEST_ASSERT_EQUAL(id, report[2]);   // usage id
@@ -118,13 +256,13 @@ void test_make_hid_report_three_chars()
 		memset(report, 0x00, (size_t)8);
 
 		// retrieve expected values
-		char id = lo->map[i]->id;
-		char mod = lo->map[i]->mod;
+		char id = lo->map[i].id;
+		char mod = lo->map[i].mod;
 
 		// get codepoint to encode
-		uint32_t codepoint = lo->map[i]->ch;
+		uint32_t codepoint = lo->map[i].ch;
 
-		make_hid_report(report, 0, 3, codepoint, codepoint, codepoint);
+		make_hid_report(&ctx, report, 0, 3, codepoint, codepoint, codepoint);
 		TEST_ASSERT_EQUAL(mod, report[0]);  // modifier
 		TEST_ASSERT_EQUAL(0x00, report[1]); // reserved
 		TEST_ASSERT_EQUAL(id, report[2]);   // usage id
@@ -144,13 +282,13 @@ void test_make_hid_report_four_chars()
 		memset(report, 0x00, (size_t)8);
 
 		// retrieve expected values
-		char id = lo->map[i]->id;
-		char mod = lo->map[i]->mod;
+		char id = lo->map[i].id;
+		char mod = lo->map[i].mod;
 
 		// get codepoint to encode
-		uint32_t codepoint = lo->map[i]->ch;
+		uint32_t codepoint = lo->map[i].ch;
 
-		make_hid_report(report, 0, 4, codepoint, codepoint, codepoint,
+		make_hid_report(&ctx, report, 0, 4, codepoint, codepoint, codepoint,
 				codepoint);
 		TEST_ASSERT_EQUAL(mod, report[0]);  // modifier
 		TEST_ASSERT_EQUAL(0x00, report[1]); // reserved
@@ -171,13 +309,13 @@ void test_make_hid_report_five_chars()
 		memset(report, 0x00, (size_t)8);
 
 		// retrieve expected values
-		char id = lo->map[i]->id;
-		char mod = lo->map[i]->mod;
+		char id = lo->map[i].id;
+		char mod = lo->map[i].mod;
 
 		// get codepoint to encode
-		uint32_t codepoint = lo->map[i]->ch;
+		uint32_t codepoint = lo->map[i].ch;
 
-		make_hid_report(report, 0, 5, codepoint, codepoint, codepoint,
+		make_hid_report(&ctx, report, 0, 5, codepoint, codepoint, codepoint,
 				codepoint, codepoint);
 		TEST_ASSERT_EQUAL(mod, report[0]);  // modifier
 		TEST_ASSERT_EQUAL(0x00, report[1]); // reserved
@@ -198,13 +336,13 @@ void test_make_hid_report_six_chars()
 		memset(report, 0x00, (size_t)8);
 
 		// retrieve expected values
-		char id = lo->map[i]->id;
-		char mod = lo->map[i]->mod;
+		char id = lo->map[i].id;
+		char mod = lo->map[i].mod;
 
 		// get codepoint to encode
-		uint32_t codepoint = lo->map[i]->ch;
+		uint32_t codepoint = lo->map[i].ch;
 
-		make_hid_report(report, 0, 6, codepoint, codepoint, codepoint,
+		make_hid_report(&ctx, report, 0, 6, codepoint, codepoint, codepoint,
 				codepoint, codepoint, codepoint);
 		TEST_ASSERT_EQUAL(mod, report[0]);  // modifier
 		TEST_ASSERT_EQUAL(0x00, report[1]); // reserved
@@ -218,17 +356,856 @@ void test_make_hid_report_six_chars()
 }
 
 
+// bulk encoding gives the same reports as encoding one character at a time
+void test_encode_string()
+{
+	struct ReportBuf buf;
+	char text[8192];
+	size_t len = 0;
+
+	// every character of the layout, as UTF-8
+	for (int i = 0; i < lo->size && len + 4 < sizeof(text); i++) {
+		uint32_t cp = lo->map[i].ch;
+		if (cp < 0x80) {
+			text[len++] = cp;
+		} else if (cp < 0x800) {
+			text[len++] = 0xC0 | (cp >> 6);
+			text[len++] = 0x80 | (cp & 0x3F);
+		} else {
+			text[len++] = 0xE0 | (cp >> 12);
+			text[len++] = 0x80 | ((cp >> 6) & 0x3F);
+			text[len++] = 0x80 | (cp & 0x3F);
+		}
+	}
+
+	TEST_ASSERT_EQUAL(0, init_report_buf(&buf, REPORT_BOOT, 4));
+	ssize_t n = encode_string(&ctx, text, len, &buf);
+	TEST_ASSERT_EQUAL(0, buf.nerrors);
+	TEST_ASSERT_EQUAL(n, buf.len);
+
+	for (ssize_t i = 0; i < n; i++) {
+		memset(report, 0x00, (size_t)8);
+		make_hid_report(&ctx, report, 0, 1, lo->map[i].ch);
+		TEST_ASSERT_EQUAL_MEMORY(report, REPORT_AT(&buf, i), 8);
+	}
+
+	free_report_buf(&buf);
+}
+
+// unmapped characters are reported with their offset, bad UTF-8 fails
+void test_encode_string_errors()
+{
+	struct ReportBuf buf;
+	const char *text = "!\xF0\x9F\x98\x80!";
+
+	TEST_ASSERT_EQUAL(0, init_report_buf(&buf, REPORT_BOOT, 0));
+	TEST_ASSERT_EQUAL(2, encode_string(&ctx, text, strlen(text), &buf));
+	TEST_ASSERT_EQUAL(1, buf.nerrors);
+	TEST_ASSERT_EQUAL(1, buf.errors[0].offset);
+	TEST_ASSERT_EQUAL_HEX32(0x1F600, buf.errors[0].codepoint);
+
+	// truncated sequence at the end of the buffer
+	clear_report_buf(&buf);
+	TEST_ASSERT_EQUAL(-1, encode_string(&ctx, text, 3, &buf));
+	TEST_ASSERT_EQUAL(1, buf.nerrors);
+	TEST_ASSERT_EQUAL(1, buf.errors[0].offset);
+	TEST_ASSERT_EQUAL(0, buf.errors[0].codepoint);
+
+	free_report_buf(&buf);
+}
+
+// bulk decoding matches one-at-a-time decoding and finds the bad byte
+void test_utf8_decode()
+{
+	char text[100];
+	uint32_t codepoints[sizeof(text)];
+	size_t error = 0;
+
+	// ASCII longer than a block, then 2, 3 and 4 byte sequences
+	memset(text, 'x', 40);
+	strcpy(text + 40, "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80!");
+	size_t len = strlen(text);
+
+	TEST_ASSERT_EQUAL(44, utf8_decode(text, len, codepoints, &error));
+	TEST_ASSERT_EQUAL_HEX32('x', codepoints[39]);
+	TEST_ASSERT_EQUAL_HEX32(0xE9, codepoints[40]);
+	TEST_ASSERT_EQUAL_HEX32(0x20AC, codepoints[41]);
+	TEST_ASSERT_EQUAL_HEX32(0x1F600, codepoints[42]);
+	TEST_ASSERT_EQUAL_HEX32('!', codepoints[43]);
+	TEST_ASSERT_EQUAL(0, utf8_validate(text, len, NULL));
+
+	// the offset is that of the sequence, wherever it breaks
+	TEST_ASSERT_EQUAL(-1, utf8_decode(text, 47, codepoints, &error));
+	TEST_ASSERT_EQUAL(45, error);
+	TEST_ASSERT_EQUAL(-1, utf8_validate(text, 47, &error));
+	TEST_ASSERT_EQUAL(45, error);
+	text[20] = '\x80';
+	TEST_ASSERT_EQUAL(-1, utf8_decode(text, len, codepoints, &error));
+	TEST_ASSERT_EQUAL(20, error);
+	TEST_ASSERT_EQUAL(-1, utf8_validate(text, len, &error));
+	TEST_ASSERT_EQUAL(20, error);
+
+	// NUL is a character, not the end of the buffer
+	TEST_ASSERT_EQUAL(3, utf8_decode("a\0b", 3, codepoints, NULL));
+	TEST_ASSERT_EQUAL(0, codepoints[1]);
+
+	// the old interface stops at NUL and never reads past it
+	int index = 0;
+	TEST_ASSERT_EQUAL_HEX32(0xE9, getCodepoint("\xC3\xA9", &index));
+	TEST_ASSERT_EQUAL(2, index);
+	TEST_ASSERT_EQUAL(0, getCodepoint("\xC3", &(int){0}));
+}
+
+// plan the given presses and compare with the expected reports
+static void check_plan(const char (*presses)[8], size_t npresses, bool elide,
+		       const char (*expected)[8], size_t nexpected)
+{
+	struct ReportBuf in, out;
+
+	init_report_buf(&in, REPORT_BOOT, npresses);
+	init_report_buf(&out, REPORT_BOOT, 0);
+	for (size_t i = 0; i < npresses; i++)
+		append_report(&in, presses[i]);
+
+	TEST_ASSERT_EQUAL(nexpected, plan_reports(&in, &out, elide));
+	if (nexpected > 0)
+		TEST_ASSERT_EQUAL_MEMORY(expected, out.reports, nexpected * 8);
+
+	free_report_buf(&in);
+	free_report_buf(&out);
+}
+
+// without eliding, every press is followed by a release
+void test_plan_reports_classic()
+{
+	const char presses[][8] = {{0, 0, 0x04}, {0, 0, 0x04}};
+	const char expected[][8] = {{0, 0, 0x04}, {0}, {0, 0, 0x04}, {0}};
+
+	check_plan(presses, 2, false, expected, 4);
+}
+
+// releases are only inserted for repeated keys and modifier changes
+void test_plan_reports_elide()
+{
+	// a b B C C c
+	const char presses[][8] = {{0, 0, 0x04}, {0, 0, 0x05}, {2, 0, 0x05},
+				   {2, 0, 0x06}, {2, 0, 0x06}, {0, 0, 0x06}};
+	const char expected[][8] = {
+		{0, 0, 0x04}, {0, 0, 0x05}, {0},	  {2, 0, 0x05},
+		{2, 0, 0x06}, {2},	    {2, 0, 0x06}, {0},
+		{0, 0, 0x06}, {0}};
+
+	check_plan(presses, 6, true, expected, 10);
+}
+
+// identical modifier-only presses are separated by a release
+void test_plan_reports_modifier_only()
+{
+	const char presses[][8] = {{2}, {2}};
+	const char expected[][8] = {{2}, {0}, {2}, {0}};
+
+	check_plan(presses, 2, true, expected, 4);
+	check_plan(presses, 0, true, expected, 0);
+}
+
+// NKRO reports set one bit per key and are not limited to six keys
+void test_make_hid_report_nkro()
+{
+	char nkro[NKRO_REPORT_SIZE] = {0};
+	uint32_t keys[8] = {SHIFT, F1, F2, F3, F4, F5, F6, F7};
+
+	ctx.format = REPORT_NKRO;
+	TEST_ASSERT_EQUAL(0, make_hid_report_arr(&ctx, nkro, 8, 8, keys));
+
+	// F1-F7 are usages 0x3A-0x40
+	TEST_ASSERT_EQUAL_HEX8(0x02, nkro[0]);
+	TEST_ASSERT_EQUAL_HEX8(0xFC, nkro[2 + 0x3A / 8]);
+	TEST_ASSERT_EQUAL_HEX8(0x01, nkro[2 + 0x40 / 8]);
+	for (int i = 1; i < NKRO_REPORT_SIZE; i++) {
+		if (i != 2 + 0x3A / 8 && i != 2 + 0x40 / 8)
+			TEST_ASSERT_EQUAL_HEX8(0x00, nkro[i]);
+	}
+}
+
+// the planner releases repeated keys in NKRO reports too
+void test_plan_reports_nkro()
+{
+	struct ReportBuf in, out;
+
+	init_report_buf(&in, REPORT_NKRO, 0);
+	init_report_buf(&out, REPORT_NKRO, 0);
+	TEST_ASSERT_EQUAL(3, encode_string(&ctx, "\"\"#", 3, &in));
+	TEST_ASSERT_EQUAL(NKRO_REPORT_SIZE, in.report_size);
+
+	// " " # : same key twice, then different modifiers
+	TEST_ASSERT_EQUAL(6, plan_reports(&in, &out, true));
+	TEST_ASSERT_EQUAL_MEMORY(REPORT_AT(&in, 0), REPORT_AT(&out, 0),
+				 NKRO_REPORT_SIZE);
+	TEST_ASSERT_EQUAL_HEX8(lo->map[1].mod, REPORT_AT(&out, 1)[0]);
+	TEST_ASSERT_FALSE(REPORT_AT(&out, 1)[2 + lo->map[1].id / 8]);
+
+	free_report_buf(&in);
+	free_report_buf(&out);
+}
+
+// contexts with different layouts encode independently
+void test_kbd_ctx_independent()
+{
+	struct KbdCtx other;
+	struct Layout *fr = load_builtin_layout("fr");
+
+	TEST_ASSERT_NOT_NULL(fr);
+	kbd_ctx_init(&other, fr);
+
+	// the same character lands on different keys per layout
+	TEST_ASSERT_EQUAL(0, make_hid_report(&other, report, 0, 1, 'a'));
+	TEST_ASSERT_EQUAL_HEX8(0x14, report[2]);
+	TEST_ASSERT_EQUAL(0, make_hid_report(&ctx, report, 0, 1, 'a'));
+	TEST_ASSERT_EQUAL_HEX8(0xE3, report[2]);
+
+	destroy_layout(fr);
+}
+
+// every ASCII kernel agrees with the general lookup, wherever a run ends
+void test_encode_ascii_kernels()
+{
+	struct Layout *us = load_builtin_layout("en-us");
+	char text[200], expected[8];
+	char *reports = malloc(sizeof(text) * HID_REPORT_SIZE);
+	struct KbdCtx usctx;
+
+	TEST_ASSERT_NOT_NULL(us);
+	kbd_ctx_init(&usctx, us);
+	for (size_t i = 0; i < sizeof(text); i++)
+		text[i] = 0x20 + (i * 7) % 0x5F;
+
+	for (int k = ASCII_KERNEL_SCALAR; k <= ASCII_KERNEL_NEON; k++) {
+		if (select_ascii_kernel(k))
+			continue;
+
+		// end the run with a non-ASCII byte, then an unmapped one
+		for (size_t end = 0; end < 70; end++) {
+			for (int stop = 0; stop < 2; stop++) {
+				char saved = text[end];
+				text[end] = stop ? 0x01 : 0xC3;
+
+				size_t n = encode_ascii(us->index, text, sizeof(text),
+							reports);
+				TEST_ASSERT_EQUAL(end, n);
+				for (size_t i = 0; i < n; i++) {
+					memset(expected, 0, sizeof(expected));
+					make_hid_report(&usctx, expected, 0, 1,
+							text[i]);
+					TEST_ASSERT_EQUAL_MEMORY(
+						expected,
+						reports + i * HID_REPORT_SIZE,
+						HID_REPORT_SIZE);
+				}
+				text[end] = saved;
+			}
+		}
+
+		TEST_ASSERT_EQUAL(sizeof(text), encode_ascii(us->index, text,
+							     sizeof(text),
+							     reports));
+	}
+
+	TEST_ASSERT_EQUAL(0, select_ascii_kernel(ASCII_KERNEL_AUTO));
+	free(reports);
+	destroy_layout(us);
+}
+
+// runs of reports go out in batches, one report per iovec
+void test_hid_out_write()
+{
+	char reports[100 * HID_REPORT_SIZE], readback[sizeof(reports)];
+	int fds[2];
+
+	for (size_t i = 0; i < sizeof(reports); i++)
+		reports[i] = i;
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+
+	struct HidOut *out = hid_out_fdopen(fds[1], HID_REPORT_SIZE);
+	TEST_ASSERT_NOT_NULL(out);
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 100));
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 2));
+	TEST_ASSERT_EQUAL(102, out->reports);
+	TEST_ASSERT_EQUAL(3, out->syscalls);
+	hid_out_close(out);
+
+	// the descriptor belongs to the caller
+	TEST_ASSERT_EQUAL(1, write(fds[1], "", 1));
+	close(fds[1]);
+
+	TEST_ASSERT_EQUAL(sizeof(reports), read(fds[0], readback,
+						sizeof(readback)));
+	TEST_ASSERT_EQUAL_MEMORY(reports, readback, sizeof(reports));
+	close(fds[0]);
+}
+
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// io_uring output queues writes and pauses in order without waiting
+void test_hid_out_uring()
+{
+	char reports[200 * HID_REPORT_SIZE], readback[sizeof(reports)];
+	int fds[2];
+
+	for (size_t i = 0; i < sizeof(reports); i++)
+		reports[i] = i;
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+
+	struct HidOut *out = hid_out_uring_fdopen(fds[1], HID_REPORT_SIZE);
+	if (out == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		TEST_IGNORE_MESSAGE("io_uring not available");
+	}
+
+	double start = now_ms();
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 100));
+	TEST_ASSERT_EQUAL(0, hid_out_delay(out, 200));
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports + 100 * HID_REPORT_SIZE,
+					   100));
+	// well short of the pause, even if the machine stalls
+	TEST_ASSERT_TRUE(now_ms() - start < 150);
+	TEST_ASSERT_EQUAL(0, hid_out_flush(out));
+	TEST_ASSERT_TRUE(now_ms() - start >= 200);
+	TEST_ASSERT_EQUAL(200, out->reports);
+	TEST_ASSERT_TRUE(out->syscalls < 10);
+	hid_out_close(out);
+	close(fds[1]);
+
+	size_t got = 0;
+	ssize_t n;
+	while ((n = read(fds[0], readback + got, sizeof(readback) - got)) > 0)
+		got += n;
+	TEST_ASSERT_EQUAL(sizeof(reports), got);
+	TEST_ASSERT_EQUAL_MEMORY(reports, readback, sizeof(reports));
+	close(fds[0]);
+}
+
+// a pipeline hands writes and pauses to its writer thread in order
+void test_hid_out_pipeline()
+{
+	char reports[200 * HID_REPORT_SIZE], readback[sizeof(reports)];
+	int fds[2];
+
+	for (size_t i = 0; i < sizeof(reports); i++)
+		reports[i] = i;
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+
+	struct HidOut *out =
+		hid_out_pipeline(hid_out_fdopen(fds[1], HID_REPORT_SIZE));
+	TEST_ASSERT_NOT_NULL(out);
+
+	double start = now_ms();
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 100));
+	TEST_ASSERT_EQUAL(0, hid_out_delay(out, 200));
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports + 100 * HID_REPORT_SIZE,
+					   100));
+	// well short of the pause, even if the machine stalls
+	TEST_ASSERT_TRUE(now_ms() - start < 150);
+	TEST_ASSERT_EQUAL(0, hid_out_flush(out));
+	TEST_ASSERT_TRUE(now_ms() - start >= 200);
+	TEST_ASSERT_EQUAL(200, out->reports);
+	TEST_ASSERT_TRUE(out->syscalls > 0);
+	hid_out_close(out);
+	close(fds[1]);
+
+	size_t got = 0;
+	ssize_t n;
+	while ((n = read(fds[0], readback + got, sizeof(readback) - got)) > 0)
+		got += n;
+	TEST_ASSERT_EQUAL(sizeof(reports), got);
+	TEST_ASSERT_EQUAL_MEMORY(reports, readback, sizeof(reports));
+	close(fds[0]);
+}
+
+// pauses keep to a schedule, and a rate spaces reports evenly
+void test_hid_out_pacing()
+{
+	char reports[21 * HID_REPORT_SIZE] = {0};
+	double took, best;
+	int fds[2];
+
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+
+	// time spent between pauses comes off the next pause; added up
+	// instead, it would take at least 150 ms. A stall of the machine
+	// only ever adds time, so the quickest of a few tries counts.
+	best = 1e9;
+	for (int try = 0; try < 5 && best >= 140; try++) {
+		struct HidOut *out = hid_out_fdopen(fds[1], HID_REPORT_SIZE);
+		TEST_ASSERT_NOT_NULL(out);
+
+		double start = now_ms();
+		for (int i = 0; i < 10; i++) {
+			TEST_ASSERT_EQUAL(0, hid_out_delay(out, 10));
+			for (double busy = now_ms(); now_ms() - busy < 5;)
+				;
+		}
+		took = now_ms() - start;
+		TEST_ASSERT_TRUE(took >= 100);
+		if (took < best)
+			best = took;
+		hid_out_close(out);
+	}
+	TEST_ASSERT_TRUE(best < 140);
+
+	// 200 reports per second puts 5 ms between reports
+	best = 1e9;
+	for (int try = 0; try < 5 && best >= 150; try++) {
+		struct HidOut *out = hid_out_fdopen(fds[1], HID_REPORT_SIZE);
+		TEST_ASSERT_NOT_NULL(out);
+		hid_out_set_rate(out, 200);
+
+		double start = now_ms();
+		TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 21));
+		took = now_ms() - start;
+		TEST_ASSERT_TRUE(took >= 95);
+		TEST_ASSERT_EQUAL(21, out->reports);
+		if (took < best)
+			best = took;
+		hid_out_close(out);
+	}
+	TEST_ASSERT_TRUE(best < 150);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// pinning accepts existing CPUs only
+void test_rt_pin_cpu()
+{
+	TEST_ASSERT_EQUAL(-1, rt_pin_cpu(-1));
+	TEST_ASSERT_EQUAL(EINVAL, errno);
+	TEST_ASSERT_EQUAL(0, rt_pin_cpu(0));
+}
+
+// a trace stamps reports with virtual time and never sleeps
+void test_hid_out_trace()
+{
+	char report[HID_REPORT_SIZE] = {2, 0, 4};
+	const char *expected = "0.000 02 00 04 00 00 00 00 00\n"
+			       "3600000.000 02 00 04 00 00 00 00 00\n"
+			       "3600000.250 02 00 04 00 00 00 00 00\n";
+	char readback[256] = {0};
+	int fds[2];
+
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+	struct HidOut *out = hid_out_trace_fdopen(fds[1], HID_REPORT_SIZE);
+	TEST_ASSERT_NOT_NULL(out);
+
+	double start = now_ms();
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, report, 1));
+	TEST_ASSERT_EQUAL(0, hid_out_delay(out, 3600000));
+	hid_out_set_rate(out, 4000);
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, report, 1));
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, report, 1));
+	hid_out_close(out);
+	TEST_ASSERT_TRUE(now_ms() - start < 100);
+	close(fds[1]);
+
+	TEST_ASSERT_EQUAL(strlen(expected),
+			  read(fds[0], readback, sizeof(readback)));
+	TEST_ASSERT_EQUAL_STRING(expected, readback);
+	close(fds[0]);
+}
+
+// captures record time and source of every report, and can be appended to
+void test_hid_out_capture()
+{
+	char reports[2 * HID_REPORT_SIZE] = {2, 0, 4};
+	char path[] = "/tmp/armorykbd-capture-XXXXXX";
+	int fd = mkstemp(path);
+	struct Capture cap;
+
+	TEST_ASSERT_TRUE(fd >= 0);
+	unlink(path);
+
+	struct HidOut *out = hid_out_capture_fdopen(fd, HID_REPORT_SIZE, true);
+	TEST_ASSERT_NOT_NULL(out);
+	out->line = 3;
+	out->cmd = CMD_STRING;
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 2));
+	TEST_ASSERT_EQUAL(0, hid_out_delay(out, 1500));
+	out->line = 4;
+	out->cmd = CMD_KEY;
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 1));
+	hid_out_close(out);
+
+	// appending needs the same kind of capture
+	TEST_ASSERT_NULL(hid_out_capture_fdopen(fd, HID_REPORT_SIZE, false));
+	TEST_ASSERT_EQUAL(EINVAL, errno);
+	out = hid_out_capture_fdopen(fd, HID_REPORT_SIZE, true);
+	TEST_ASSERT_NOT_NULL(out);
+	TEST_ASSERT_EQUAL(0, hid_out_write(out, reports, 1));
+	hid_out_close(out);
+
+	TEST_ASSERT_EQUAL(0, map_capture(fd, &cap));
+	TEST_ASSERT_EQUAL(HID_REPORT_SIZE, cap.header->report_size);
+	TEST_ASSERT_EQUAL(CAPTURE_VIRTUAL, cap.header->flags);
+	TEST_ASSERT_EQUAL(4, cap.count);
+
+	const struct CaptureRecord *rec = capture_record(&cap, 1);
+	TEST_ASSERT_EQUAL(0, rec->time);
+	TEST_ASSERT_EQUAL(3, rec->line);
+	TEST_ASSERT_EQUAL(CMD_STRING, rec->cmd);
+	TEST_ASSERT_EQUAL_MEMORY(reports + HID_REPORT_SIZE, rec->report,
+				 HID_REPORT_SIZE);
+	rec = capture_record(&cap, 2);
+	TEST_ASSERT_TRUE(rec->time == 1500000000ULL);
+	TEST_ASSERT_EQUAL(4, rec->line);
+	TEST_ASSERT_EQUAL(CMD_KEY, rec->cmd);
+	TEST_ASSERT_EQUAL_MEMORY(reports, rec->report, HID_REPORT_SIZE);
+	TEST_ASSERT_EQUAL(0, capture_record(&cap, 3)->time);
+
+	unmap_capture(&cap);
+	close(fd);
+}
+
+// scripts compile up front, then run without parsing
+void test_compile_script()
+{
+	char script[] = "ENTER\nREPEAT 1\nDELAY 5\nBOGUS\n"
+			"DELAY 4294967296\nREPEAT -1\nDEFAULT_DELAY -5\n"
+			"SIMUL CTRL \xe8\xaa\x9e\n";
+	const char *expected = "0.000 00 00 28 00 00 00 00 00\n"
+			       "0.000 00 00 00 00 00 00 00 00\n"
+			       "0.000 00 00 28 00 00 00 00 00\n"
+			       "0.000 00 00 00 00 00 00 00 00\n";
+	char readback[256] = {0};
+	struct Program prog;
+	int fds[2];
+
+	FILE *file = fmemopen(script, strlen(script), "r");
+	TEST_ASSERT_NOT_NULL(file);
+	TEST_ASSERT_EQUAL(0, init_program(&prog, ctx.format));
+	// the bad lines, numbers out of range and a chord with a key the
+	// layout has no mapping for are found before anything is sent
+	TEST_ASSERT_EQUAL(5, compile_script(&ctx, file, &prog));
+	fclose(file);
+
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+	struct HidOut *out = hid_out_trace_fdopen(fds[1], HID_REPORT_SIZE);
+	TEST_ASSERT_NOT_NULL(out);
+	TEST_ASSERT_EQUAL(0, run_program(&prog, out));
+	TEST_ASSERT_EQUAL(3, out->line);
+	TEST_ASSERT_EQUAL(CMD_DELAY, out->cmd);
+	TEST_ASSERT_EQUAL(5000000, out->due);
+	// a trace never sleeps, so it has no wake-up latency to report
+	TEST_ASSERT_EQUAL(-1, out->max_latency);
+
+	// a malformed program is refused
+	prog.code[0] = 0xFF;
+	TEST_ASSERT_EQUAL(-1, run_program(&prog, out));
+	TEST_ASSERT_EQUAL(EINVAL, errno);
+	hid_out_close(out);
+	close(fds[1]);
+
+	TEST_ASSERT_EQUAL(strlen(expected),
+			  read(fds[0], readback, sizeof(readback)));
+	TEST_ASSERT_EQUAL_STRING(expected, readback);
+	close(fds[0]);
+	free_program(&prog);
+
+	// bad UTF-8 fails the compile, and leaves exiting to the caller
+	char bad[] = "STRING \xff\n";
+	file = fmemopen(bad, strlen(bad), "r");
+	TEST_ASSERT_NOT_NULL(file);
+	TEST_ASSERT_EQUAL(0, init_program(&prog, ctx.format));
+	TEST_ASSERT_EQUAL(-1, compile_script(&ctx, file, &prog));
+	TEST_ASSERT_EQUAL(EILSEQ, errno);
+	fclose(file);
+	free_program(&prog);
+}
+
+// scripts are read in place: blocks span lines, and lines have no limit
+void test_compile_string_block()
+{
+	char path[] = "/tmp/armorykbd-script-XXXXXX";
+	int fd = mkstemp(path);
+	char line[600];
+	struct Program prog;
+
+	TEST_ASSERT_TRUE(fd >= 0);
+	unlink(path);
+	FILE *file = fdopen(fd, "w+");
+	TEST_ASSERT_NOT_NULL(file);
+	memset(line, 'a', sizeof(line));
+	fputs("STRING_BLOCK\nab\nEND_STRING\nSTRING ", file);
+	fwrite(line, 1, sizeof(line), file);
+	fputs("\nEND_STRING\n", file);
+	rewind(file);
+
+	TEST_ASSERT_EQUAL(0, init_program(&prog, ctx.format));
+	// END_STRING outside a block is an error
+	TEST_ASSERT_EQUAL(1, compile_script(&ctx, file, &prog));
+	fclose(file);
+
+	struct HidOut *out = hid_out_trace_fdopen(open("/dev/null", O_WRONLY),
+						  HID_REPORT_SIZE);
+	TEST_ASSERT_NOT_NULL(out);
+	TEST_ASSERT_EQUAL(0, run_program(&prog, out));
+	// a, b and Enter, then every a of the long line, each released
+	TEST_ASSERT_EQUAL(2 * 3 + 2 * sizeof(line), out->reports);
+	close(out->fd);
+	hid_out_close(out);
+	free_program(&prog);
+}
+
+// payloads pack repeated reports, and map back to the same program
+void test_payload_round_trip()
+{
+	char script[] = "STRING ababababababababababababab\nREPEAT 3\n";
+	char path[] = "/tmp/armorykbd-payload-XXXXXX";
+	int fd = mkstemp(path);
+	struct Program prog, mapped;
+
+	TEST_ASSERT_TRUE(fd >= 0);
+	unlink(path);
+
+	FILE *file = fmemopen(script, strlen(script), "r");
+	TEST_ASSERT_NOT_NULL(file);
+	TEST_ASSERT_EQUAL(0, init_program(&prog, ctx.format));
+	TEST_ASSERT_EQUAL(0, compile_script(&ctx, file, &prog));
+	fclose(file);
+	// 60 reports, far smaller packed
+	TEST_ASSERT_EQUAL(OP_EMIT_PACKED, prog.code[9]);
+	TEST_ASSERT_TRUE(prog.len < 60 * HID_REPORT_SIZE / 4);
+
+	TEST_ASSERT_EQUAL(0, save_program(&prog, fd));
+	TEST_ASSERT_EQUAL(0, map_program(fd, &mapped));
+	TEST_ASSERT_EQUAL(prog.format, mapped.format);
+	TEST_ASSERT_EQUAL(prog.len, mapped.len);
+	TEST_ASSERT_EQUAL_MEMORY(prog.code, mapped.code, prog.len);
+	free_program(&mapped);
+
+	// a loop forward, or cut short, is refused
+	prog.code[prog.len - 8] = 0xFF;
+	TEST_ASSERT_EQUAL(-1, check_program(&prog));
+	prog.len--;
+	TEST_ASSERT_EQUAL(-1, check_program(&prog));
+
+	// an a, repeated once, then a loop over it
+	unsigned char packed[] = {1, 2, 0xE3, PACK_RUN, 1, 1};
+	uint32_t emit[] = {2, sizeof(packed)}, loop[] = {3, 0, 15};
+	prog.len = 0;
+	prog.code[prog.len++] = OP_EMIT_PACKED;
+	memcpy(prog.code + prog.len, emit, sizeof(emit));
+	prog.len += sizeof(emit);
+	memcpy(prog.code + prog.len, packed, sizeof(packed));
+	prog.len += sizeof(packed);
+	prog.code[prog.len++] = OP_LOOP;
+	memcpy(prog.code + prog.len, loop, sizeof(loop));
+	prog.len += sizeof(loop);
+	TEST_ASSERT_EQUAL(0, check_program(&prog));
+	// a loop over the packed reports as if they were code is refused
+	prog.code[prog.len - 8] = 9;
+	prog.code[prog.len - 4] = sizeof(packed);
+	TEST_ASSERT_EQUAL(-1, check_program(&prog));
+	prog.code[prog.len - 8] = 0;
+	prog.code[prog.len - 4] = 15;
+	// so is a run past the end of the reports, before any is sent
+	prog.code[14] = 2;
+	TEST_ASSERT_EQUAL(-1, check_program(&prog));
+	prog.code[14] = 1;
+	// and a loop over a loop, which would nest
+	prog.code[prog.len++] = OP_LOOP;
+	loop[2] = prog.len - 1;
+	memcpy(prog.code + prog.len, loop, sizeof(loop));
+	prog.len += sizeof(loop);
+	TEST_ASSERT_EQUAL(-1, check_program(&prog));
+	// while a second loop over the same reports is fine
+	loop[2] = 15;
+	memcpy(prog.code + prog.len - sizeof(loop), loop, sizeof(loop));
+	TEST_ASSERT_EQUAL(0, check_program(&prog));
+
+	free_program(&prog);
+	close(fd);
+}
+
+// compiled scripts are found again by key, and the oldest go first
+void test_script_cache()
+{
+	char dir[] = "/tmp/armorykbd-cache-XXXXXX";
+	char path[PATH_MAX];
+	struct ScriptCache cache;
+	struct CacheKey key, other, old_key;
+	struct Program prog, cached;
+
+	TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+	init_program(&prog, ctx.format);
+	prog.len = 1;
+	prog.code[0] = OP_DEFAULT_DELAY;
+
+	init_cache_key(&key, &ctx);
+	add_cache_key(&key, "STRING a", 8);
+	init_cache_key(&other, &ctx);
+	add_cache_key(&other, "STRING b", 8);
+	TEST_ASSERT_TRUE(key.hash != other.hash);
+	// an upgraded encoder does not pick up what older ones compiled
+	init_cache_key_version(&old_key, &ctx, ENCODER_VERSION - 1);
+	add_cache_key(&old_key, "STRING a", 8);
+	TEST_ASSERT_TRUE(key.hash != old_key.hash);
+
+	// a run that died while storing left a temporary file behind long
+	// ago, and another run is storing one now
+	struct timespec old[2] = {{.tv_sec = 1}, {.tv_sec = 1}};
+	snprintf(path, sizeof(path), "%s/.tmp-dead01", dir);
+	close(open(path, O_WRONLY | O_CREAT, 0600));
+	TEST_ASSERT_EQUAL(0, utimensat(AT_FDCWD, path, old, 0));
+	snprintf(path, sizeof(path), "%s/.tmp-live01", dir);
+	close(open(path, O_WRONLY | O_CREAT, 0600));
+
+	// room for one payload only
+	TEST_ASSERT_EQUAL(0, open_cache(&cache, dir,
+					sizeof(struct PayloadHeader) + 1));
+	TEST_ASSERT_EQUAL(0, access(path, F_OK));
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/.tmp-dead01", dir);
+	TEST_ASSERT_EQUAL(-1, access(path, F_OK));
+	TEST_ASSERT_EQUAL(-1, load_cached(&cache, &key, &cached));
+	TEST_ASSERT_EQUAL(0, store_cached(&cache, &key, &prog));
+	TEST_ASSERT_EQUAL(0, load_cached(&cache, &key, &cached));
+	TEST_ASSERT_EQUAL(1, cached.len);
+	TEST_ASSERT_EQUAL(OP_DEFAULT_DELAY, cached.code[0]);
+	free_program(&cached);
+	TEST_ASSERT_EQUAL(1, cache.hits);
+	TEST_ASSERT_EQUAL(1, cache.misses);
+
+	// make the first payload the least recently used
+	snprintf(path, sizeof(path), "%s/%016llx.akp", dir,
+		 (unsigned long long)key.hash);
+	TEST_ASSERT_EQUAL(0, utimensat(AT_FDCWD, path, old, 0));
+
+	TEST_ASSERT_EQUAL(0, store_cached(&cache, &other, &prog));
+	TEST_ASSERT_EQUAL(0, load_cached(&cache, &other, &cached));
+	free_program(&cached);
+	TEST_ASSERT_EQUAL(-1, load_cached(&cache, &key, &cached));
+
+	free_program(&prog);
+	snprintf(path, sizeof(path), "%s/%016llx.akp", dir,
+		 (unsigned long long)other.hash);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	unlink(path);
+	TEST_ASSERT_EQUAL(0, rmdir(dir));
+}
+
+// a host that stops reading makes writes time out, not hang
+void test_hid_out_timeout()
+{
+	char report[HID_REPORT_SIZE] = {2, 0, 4}, up[HID_REPORT_SIZE] = {0};
+	char chunk[4096] = {0};
+
+	// descriptors only turn non-blocking once there is a deadline
+	int pfds[2];
+	TEST_ASSERT_EQUAL(0, pipe(pfds));
+	struct HidOut *plain = hid_out_fdopen(pfds[1], HID_REPORT_SIZE);
+	TEST_ASSERT_NOT_NULL(plain);
+	TEST_ASSERT_EQUAL(0, hid_out_set_timeout(plain, -1));
+	TEST_ASSERT_FALSE(fcntl(pfds[1], F_GETFL) & O_NONBLOCK);
+	TEST_ASSERT_EQUAL(0, hid_out_set_timeout(plain, 50));
+	TEST_ASSERT_TRUE(fcntl(pfds[1], F_GETFL) & O_NONBLOCK);
+	hid_out_close(plain);
+	close(pfds[0]);
+	close(pfds[1]);
+
+	// synchronous, io_uring and pipelined output
+	for (int backend = 0; backend < 3; backend++) {
+		int fds[2];
+		TEST_ASSERT_EQUAL(0, pipe(fds));
+		TEST_ASSERT_EQUAL(0, set_blocking(fds[0], false));
+		TEST_ASSERT_EQUAL(0, set_blocking(fds[1], false));
+
+		// fill the pipe
+		while (write(fds[1], chunk, sizeof(chunk)) > 0)
+			;
+
+		struct HidOut *out;
+		if (backend == 1)
+			out = hid_out_uring_fdopen(fds[1], HID_REPORT_SIZE);
+		else
+			out = hid_out_fdopen(fds[1], HID_REPORT_SIZE);
+		if (out == NULL) {
+			close(fds[0]);
+			close(fds[1]);
+			continue;
+		}
+		TEST_ASSERT_EQUAL(0, hid_out_set_timeout(out, 50));
+		if (backend == 2)
+			TEST_ASSERT_NOT_NULL(out = hid_out_pipeline(out));
+
+		double start = now_ms();
+		int ret = hid_out_write(out, report, 1);
+		if (ret == 0)
+			ret = hid_out_flush(out);
+		TEST_ASSERT_EQUAL(-1, ret);
+		TEST_ASSERT_EQUAL(ETIMEDOUT, errno);
+		TEST_ASSERT_TRUE(now_ms() - start >= 50);
+
+		// once the host reads again, all keys are released
+		while (read(fds[0], chunk, sizeof(chunk)) > 0)
+			;
+		TEST_ASSERT_EQUAL(0, hid_out_abort(out));
+		TEST_ASSERT_EQUAL(HID_REPORT_SIZE,
+				  read(fds[0], chunk, sizeof(chunk)));
+		TEST_ASSERT_EQUAL_MEMORY(up, chunk, HID_REPORT_SIZE);
+
+		hid_out_close(out);
+		close(fds[0]);
+		close(fds[1]);
+	}
+}
+
 int main(void)
 {
 	UNITY_BEGIN();
 	RUN_TEST(test_layout_file_loaded);
 	RUN_TEST(test_all_fail_when_no_layout_set);
 	RUN_TEST(test_make_hid_report_arr_nullargs_fails);
+	RUN_TEST(test_layout_map_is_aligned);
+	RUN_TEST(test_map_codepoint_unmapped);
+	RUN_TEST(test_layout_binary_round_trip);
+	RUN_TEST(test_layout_binary_rejects_bad_image);
+	RUN_TEST(test_builtin_layouts);
+	RUN_TEST(test_lookup_keyword);
+	RUN_TEST(test_escape_table);
 	RUN_TEST(test_make_hid_report_one_char);
 	RUN_TEST(test_make_hid_report_two_chars);
 	RUN_TEST(test_make_hid_report_three_chars);
 	RUN_TEST(test_make_hid_report_four_chars);
 	RUN_TEST(test_make_hid_report_five_chars);
 	RUN_TEST(test_make_hid_report_six_chars);
+	RUN_TEST(test_encode_string);
+	RUN_TEST(test_encode_string_errors);
+	RUN_TEST(test_utf8_decode);
+	RUN_TEST(test_plan_reports_classic);
+	RUN_TEST(test_plan_reports_elide);
+	RUN_TEST(test_plan_reports_modifier_only);
+	RUN_TEST(test_make_hid_report_nkro);
+	RUN_TEST(test_plan_reports_nkro);
+	RUN_TEST(test_kbd_ctx_independent);
+	RUN_TEST(test_encode_ascii_kernels);
+	RUN_TEST(test_hid_out_write);
+	RUN_TEST(test_hid_out_uring);
+	RUN_TEST(test_hid_out_pipeline);
+	RUN_TEST(test_hid_out_pacing);
+	RUN_TEST(test_hid_out_trace);
+	RUN_TEST(test_hid_out_capture);
+	RUN_TEST(test_compile_script);
+	RUN_TEST(test_compile_string_block);
+	RUN_TEST(test_payload_round_trip);
+	RUN_TEST(test_script_cache);
+	RUN_TEST(test_hid_out_timeout);
+	RUN_TEST(test_rt_pin_cpu);
 	return UNITY_END();
 }